@@ -22,7 +22,7 @@ if [ -z "${FAST:-}" ]; then
     docker exec "$container" apt-get upgrade -y
     docker exec "$container" apt-get install -y $cc
     docker exec "$container" apt-get install -y make pkg-config
-    docker exec "$container" apt-get install -y libbsd-dev libconfig-dev libmodbus-dev libmosquitto-dev
+    docker exec "$container" apt-get install -y libbsd-dev libconfig-dev libmodbus-dev libmosquitto-dev zlib1g-dev
     docker exec "$container" apt-get autoremove -y --purge
 fi
 
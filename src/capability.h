@@ -0,0 +1,157 @@
+#ifndef GROWATT_CAPABILITY_H
+#define GROWATT_CAPABILITY_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "growatt.h"
+#include "log.h"
+
+#undef LOG_TAG
+#define LOG_TAG "95m[CAPA] "
+
+enum {
+  CAPABILITY_ADDRESS_SPACE = 256U, // register tables address at most 255
+  CAPABILITY_LINE_SIZE = 512U,
+};
+
+typedef enum {
+  ADDRESS_UNKNOWN = 0, // not scanned, or no answer: assumed supported
+  ADDRESS_UNSUPPORTED, // the device answers with an exception
+  ADDRESS_LIVE,        // value changed while scanning
+  ADDRESS_CONSTANT,    // value did not change while scanning
+} ADDRESS_STATE;
+
+static const char *const address_states[] = {"unknown", "unsupported", "live", "constant"};
+
+/**
+ * What one register type of a unit looks like, as found by --scan
+ */
+typedef struct {
+  uint8_t states[CAPABILITY_ADDRESS_SPACE];
+  /** Last value read while scanning */
+  uint16_t values[CAPABILITY_ADDRESS_SPACE];
+} CAPABILITY_MAP;
+
+typedef struct {
+  /** Loaded from the cache or freshly scanned, otherwise every address is assumed supported */
+  bool known;
+  CAPABILITY_MAP holding;
+  CAPABILITY_MAP input;
+} CAPABILITY;
+
+/**
+ * Whether length addresses from address are all worth reading
+ */
+bool capability_supported(const CAPABILITY_MAP *map, const int address, const int length) {
+  for (int i = address; i < address + length; i++) {
+    if (i >= (int)CAPABILITY_ADDRESS_SPACE || map->states[i] == ADDRESS_UNSUPPORTED) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * Write one line per run of addresses sharing the same state (and value when constant):
+ * "<slave_id> <holding|input> <first> <last> <state> [<value>]"
+ */
+static void capability_write_map(FILE *file, const int slave_id, char const type[static 1], const CAPABILITY_MAP *map) {
+  size_t first = 0;
+  while (first < CAPABILITY_ADDRESS_SPACE) {
+    const uint8_t state = map->states[first];
+    size_t last = first;
+    while (last + 1 < CAPABILITY_ADDRESS_SPACE && map->states[last + 1] == state &&
+           (state != ADDRESS_CONSTANT || map->values[last + 1] == map->values[first])) {
+      last++;
+    }
+
+    if (state == ADDRESS_CONSTANT) {
+      fprintf(file, "%d %s %zu %zu %s %" PRIu16 "\n", slave_id, type, first, last, address_states[state], map->values[first]);
+    } else if (state != ADDRESS_UNKNOWN) {
+      fprintf(file, "%d %s %zu %zu %s\n", slave_id, type, first, last, address_states[state]);
+    }
+
+    first = last + 1;
+  }
+}
+
+void capability_write(FILE *file, const int slave_id, const CAPABILITY *capability) {
+  capability_write_map(file, slave_id, "holding", &capability->holding);
+  capability_write_map(file, slave_id, "input", &capability->input);
+}
+
+/**
+ * Load what is known about slave_id from the cache file at path, written by --scan for device_or_uri.
+ * A missing cache is not an error, one written for another device is ignored.
+ */
+int capability_load(char const path[static 1], char const device_or_uri[static 1], const int slave_id, CAPABILITY *capability) {
+  memset(capability, 0, sizeof(*capability));
+
+  FILE *file = fopen(path, "re");
+  if (file == NULL) {
+    if (errno != ENOENT) {
+      PERROR("Cannot open capability cache %s", path);
+    }
+    return errno == ENOENT ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  char line[CAPABILITY_LINE_SIZE];
+  int code = EXIT_SUCCESS;
+  while (code == EXIT_SUCCESS && fgets(line, sizeof(line), file)) {
+    char device[CAPABILITY_LINE_SIZE] = {0};
+    char type[CAPABILITY_LINE_SIZE] = {0};
+    char state[CAPABILITY_LINE_SIZE] = {0};
+    int id = 0;
+    size_t first = 0;
+    size_t last = 0;
+    unsigned value = 0;
+
+    if (line[0] == '#' || line[0] == '\n') {
+      continue;
+    }
+
+    if (sscanf(line, "device %511s", device) == 1) { // NOLINT(cert-err34-c)
+      if (strcmp(device, device_or_uri) != 0) {
+        LOG(LOG_ERROR, "Capability cache %s was written for %s, ignoring it", path, device);
+        memset(capability, 0, sizeof(*capability));
+        break;
+      }
+      continue;
+    }
+
+    // NOLINTNEXTLINE(cert-err34-c)
+    const int fields = sscanf(line, "%d %511s %zu %zu %511s %u", &id, type, &first, &last, state, &value);
+    CAPABILITY_MAP *map = !strcmp(type, "holding") ? &capability->holding : (!strcmp(type, "input") ? &capability->input : NULL);
+    size_t index = 0;
+    while (index < COUNT(address_states) && strcmp(state, address_states[index]) != 0) {
+      index++;
+    }
+
+    if (fields < 5 || map == NULL || first > last || last >= CAPABILITY_ADDRESS_SPACE || index == COUNT(address_states)) {
+      LOG(LOG_ERROR, "Invalid line in capability cache %s: %s", path, line);
+      code = EXIT_FAILURE;
+    } else if (id == slave_id) {
+      for (size_t address = first; address <= last; address++) {
+        map->states[address] = (uint8_t)index;
+        map->values[address] = (uint16_t)value;
+      }
+      capability->known = true;
+    }
+  }
+
+  fclose(file);
+
+  if (code != EXIT_SUCCESS) {
+    memset(capability, 0, sizeof(*capability));
+  }
+
+  return code;
+}
+
+#endif /* GROWATT_CAPABILITY_H */
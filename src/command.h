@@ -0,0 +1,144 @@
+#ifndef GROWATT_COMMAND_H
+#define GROWATT_COMMAND_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <time.h>
+
+#include "growatt.h"
+
+enum {
+  COMMAND_QUEUE_SIZE = 16U,
+};
+
+typedef enum {
+  COMMAND_QUEUED = EXIT_SUCCESS,
+  COMMAND_UNKNOWN, // no writable register by that name
+  COMMAND_INVALID, // value outside of the register's range
+  COMMAND_FULL,
+} COMMAND_STATUS;
+
+/**
+ * Setting to write into a holding register
+ */
+typedef struct {
+  /** Index of the unit on the bus */
+  size_t slave;
+  const REGISTER *reg;
+  double value;
+  /** Monotonic time the command was queued at, in ms */
+  double queued_at;
+} COMMAND;
+
+/**
+ * Bounded FIFO of commands drained by the Modbus thread in between two transactions, so that a command only waits
+ * for the transaction in progress rather than for a whole cycle.
+ * Use mutex to access entries, head and the totals; size can be peeked without it.
+ */
+typedef struct {
+  mtx_t mutex;
+  COMMAND entries[COMMAND_QUEUE_SIZE];
+  size_t head;
+  atomic_size_t size;
+  size_t succeeded_total;
+  size_t failed_total;
+  /** Commands refused because the queue was full or the value invalid */
+  size_t rejected_total;
+  /** Time from queueing to verified write of the last command, in ms */
+  double latency;
+} COMMAND_QUEUE;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static COMMAND_QUEUE commands;
+
+int init_commands(void) { return mtx_init(&commands.mutex, mtx_plain) == thrd_success ? EXIT_SUCCESS : EXIT_FAILURE; }
+
+const REGISTER *find_setting(char const name[static 1]) {
+  for (size_t i = 0; i < COUNT(holding_registers); i++) {
+    if (holding_registers[i].writable && strcmp(holding_registers[i].metric_name, name) == 0) {
+      return &holding_registers[i];
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Queue a write of value into the setting named metric_name of the unit at index slave.
+ * A command already queued for the same setting is updated in place: only the latest value matters.
+ */
+COMMAND_STATUS queue_command(const size_t slave, char const metric_name[static 1], const double value, const double now) {
+  const REGISTER *reg = find_setting(metric_name);
+  if (reg == NULL) {
+    return COMMAND_UNKNOWN;
+  }
+
+  const CHECK *check = &reg->check;
+  const double raw = value / reg->scale;
+  const double raw_max = reg->register_size == REGISTER_DOUBLE ? UINT32_MAX : UINT16_MAX;
+  COMMAND_STATUS status = COMMAND_QUEUED;
+
+  mtx_lock(&commands.mutex);
+
+  if (!(raw >= 0 && raw <= raw_max) || (check->max > check->min && (value < check->min || value > check->max))) {
+    status = COMMAND_INVALID;
+  } else {
+    const size_t size = atomic_load(&commands.size);
+    size_t i = 0;
+    while (i < size && (commands.entries[(commands.head + i) % COMMAND_QUEUE_SIZE].reg != reg ||
+                        commands.entries[(commands.head + i) % COMMAND_QUEUE_SIZE].slave != slave)) {
+      i++;
+    }
+
+    if (i < size) {
+      commands.entries[(commands.head + i) % COMMAND_QUEUE_SIZE].value = value;
+    } else if (size == COMMAND_QUEUE_SIZE) {
+      status = COMMAND_FULL;
+    } else {
+      commands.entries[(commands.head + size) % COMMAND_QUEUE_SIZE] = (COMMAND){slave, reg, value, now};
+      atomic_fetch_add(&commands.size, 1);
+    }
+  }
+
+  if (status != COMMAND_QUEUED) {
+    commands.rejected_total++;
+  }
+
+  mtx_unlock(&commands.mutex);
+
+  return status;
+}
+
+/**
+ * Pop the oldest command, returns false when the queue is empty
+ */
+bool next_command(COMMAND *command) {
+  if (atomic_load(&commands.size) == 0) {
+    return false;
+  }
+
+  mtx_lock(&commands.mutex);
+  *command = commands.entries[commands.head];
+  commands.head = (commands.head + 1) % COMMAND_QUEUE_SIZE;
+  atomic_fetch_sub(&commands.size, 1);
+  mtx_unlock(&commands.mutex);
+
+  return true;
+}
+
+void command_completed(const bool succeeded, const double latency) {
+  mtx_lock(&commands.mutex);
+  if (succeeded) {
+    commands.succeeded_total++;
+    commands.latency = latency;
+  } else {
+    commands.failed_total++;
+  }
+  mtx_unlock(&commands.mutex);
+}
+
+#endif /* GROWATT_COMMAND_H */
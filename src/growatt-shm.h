@@ -0,0 +1,182 @@
+#ifndef GROWATT_GROWATT_SHM_H
+#define GROWATT_GROWATT_SHM_H
+
+/**
+ * Layout of the POSIX shared-memory segment published by growatt_exporter (see shm_name), and a reader for local
+ * processes: once mapped, values are read straight from the segment, without syscalls nor locks.
+ *
+ * The segment starts with a GROWATT_SHM_HEADER, followed by slot_count names (one per register, holding registers
+ * first, in the order of the register table), then unit_count units of unit_size bytes each: a GROWATT_SHM_UNIT followed
+ * by slot_count GROWATT_SHM_SLOTs. Each unit is guarded by a seqlock: its sequence is odd while the exporter updates it.
+ * Look slots up by name once with growatt_shm_find(), their index may change from one exporter version to the next.
+ *
+ * This header only needs the C standard library and POSIX, copy it along with your program.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+enum {
+  GROWATT_SHM_MAGIC = 0x4d485347U,       // "GSHM"
+  GROWATT_SHM_VERSION = 1U,              // bumped on incompatible layout changes
+  GROWATT_SHM_NAME_SIZE = 64U,           // metric names, terminated
+  GROWATT_SHM_READ_ATTEMPTS = 1U << 20U, // a few ms, then a unit the exporter never finished updating (it died) is given up
+};
+
+typedef struct {
+  /** GROWATT_SHM_MAGIC, written last once the rest of the segment is initialized */
+  _Atomic uint32_t magic;
+  uint32_t version;
+  uint32_t slot_count;
+  uint32_t unit_count;
+  /** Offsets from the start of the segment, in bytes */
+  uint32_t names_offset;
+  uint32_t units_offset;
+  uint32_t unit_size;
+  uint32_t reserved;
+  uint64_t size;
+} GROWATT_SHM_HEADER;
+
+typedef struct {
+  /** Odd while the exporter updates the unit */
+  _Atomic uint32_t sequence;
+  /** Modbus slave id, 0 for units which are not polled */
+  int32_t slave_id;
+  /** Time of the last update, in ms since the epoch */
+  int64_t updated_at;
+} GROWATT_SHM_UNIT;
+
+typedef struct {
+  double value;
+  /** Time the value was read, in ms since the epoch, 0 when not available (not read yet, unsupported or expired) */
+  int64_t at;
+} GROWATT_SHM_SLOT;
+
+/**
+ * Read-only mapping of the segment
+ */
+typedef struct {
+  const GROWATT_SHM_HEADER *header;
+  size_t size;
+} GROWATT_SHM;
+
+/**
+ * Map the segment published as name (e.g. "/growatt-exporter"), returns 0 or -1 with errno set
+ * (EAGAIN while the exporter initializes it, EPROTO on a layout version this header does not know)
+ */
+static inline int growatt_shm_open(GROWATT_SHM *shm, const char *name) {
+  const int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+
+  struct stat status;
+  if (fstat(fd, &status) < 0) {
+    close(fd);
+    return -1;
+  }
+  if ((size_t)status.st_size < sizeof(GROWATT_SHM_HEADER)) {
+    close(fd);
+    errno = EAGAIN;
+    return -1;
+  }
+
+  void *address = mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (address == MAP_FAILED) {
+    return -1;
+  }
+
+  const GROWATT_SHM_HEADER *header = address;
+  int error = 0;
+  if (atomic_load_explicit(&header->magic, memory_order_acquire) != GROWATT_SHM_MAGIC) {
+    error = EAGAIN;
+  } else if (header->version != GROWATT_SHM_VERSION) {
+    error = EPROTO;
+  } else if (header->size > (uint64_t)status.st_size) {
+    error = EAGAIN;
+  }
+  if (error) {
+    munmap(address, (size_t)status.st_size);
+    errno = error;
+    return -1;
+  }
+
+  shm->header = header;
+  shm->size = (size_t)status.st_size;
+
+  return 0;
+}
+
+static inline void growatt_shm_close(GROWATT_SHM *shm) {
+  if (shm->header) {
+    munmap((void *)shm->header, shm->size);
+    shm->header = NULL;
+  }
+}
+
+/**
+ * Name of the metric stored in slot
+ */
+static inline const char *growatt_shm_name(const GROWATT_SHM *shm, const size_t slot) {
+  return (const char *)shm->header + shm->header->names_offset + slot * GROWATT_SHM_NAME_SIZE;
+}
+
+/**
+ * Slot holding metric name (e.g. "battery_soc"), -1 if there is none
+ */
+static inline int growatt_shm_find(const GROWATT_SHM *shm, const char *name) {
+  for (uint32_t slot = 0; slot < shm->header->slot_count; slot++) {
+    if (!strcmp(growatt_shm_name(shm, slot), name)) {
+      return (int)slot;
+    }
+  }
+
+  return -1;
+}
+
+static inline const GROWATT_SHM_UNIT *growatt_shm_unit(const GROWATT_SHM *shm, const size_t unit) {
+  return (const GROWATT_SHM_UNIT *)((const char *)shm->header + shm->header->units_offset + unit * shm->header->unit_size);
+}
+
+/**
+ * Copy count slots of unit (0 to unit_count - 1) into values, all from the same update of the exporter.
+ * Slots are indexes from growatt_shm_find(). Returns false if the unit kept changing (or the exporter died while
+ * updating it), values are then left inconsistent.
+ */
+static inline bool growatt_shm_read(const GROWATT_SHM *shm, const size_t unit, const int *slots, const size_t count,
+                                    GROWATT_SHM_SLOT *values, int32_t *slave_id) {
+  const GROWATT_SHM_UNIT *header = growatt_shm_unit(shm, unit);
+  const GROWATT_SHM_SLOT *data = (const GROWATT_SHM_SLOT *)(header + 1);
+
+  for (int attempt = 0; attempt < GROWATT_SHM_READ_ATTEMPTS; attempt++) {
+    const uint32_t sequence = atomic_load_explicit(&header->sequence, memory_order_acquire);
+    if (sequence & 1U) {
+      continue; // being updated
+    }
+
+    for (size_t i = 0; i < count; i++) {
+      values[i] = data[slots[i]];
+    }
+    if (slave_id) {
+      *slave_id = header->slave_id;
+    }
+
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&header->sequence, memory_order_relaxed) == sequence) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+#endif /* GROWATT_GROWATT_SHM_H */
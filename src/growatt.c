@@ -3,27 +3,57 @@
 #include <assert.h>
 #include <libconfig.h>
 #include <limits.h>
+#include <semaphore.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "influx.h"
 #include "log.h"
+#include "loop.h"
 #include "mqtt.h"
 #include "prometheus.h"
+#include "scan.h"
+#include "shm.h"
+#include "sink.h"
+#include "stack.h"
+#include "state.h"
+
+#undef LOG_TAG
+#define LOG_TAG "32m[GRWT] "
 
 enum {
   RADIX_DECIMAL = 10,
+  INFLUX_BATCH = 6, // cycles
   STDC_VERSION_MIN = 201710L,
 };
 
 typedef struct __attribute__((aligned(64))) {
-  const char *device_or_uri;
+  char const *filename;
+  modbus_config modbus_config;
   prometheus_config prometheus_config;
   mqtt_config mqtt_config;
+  influx_config influx_config;
+  /** Run everything from a single epoll-driven thread instead of one thread per subsystem */
+  int event_loop;
+  /** Where metrics and schedules are kept across restarts (optional) */
+  char state_file[CONFIG_STRING_SIZE];
+  /** Record spans of the polling pipeline, written to this file on SIGUSR2 (optional) */
+  char span_file[CONFIG_STRING_SIZE];
+  /** POSIX shared-memory segment the values are published to for local readers, see growatt-shm.h (optional) */
+  char shm_name[CONFIG_STRING_SIZE];
 } config;
 
+// NOLINTBEGIN(cppcoreguidelines-avoid-non-const-global-variables)
+static sem_t supervisor; // posted upon SIGHUP, SIGUSR2 and when the Modbus thread exits
+static volatile sig_atomic_t spans_requested = 0;
+// NOLINTEND(cppcoreguidelines-avoid-non-const-global-variables)
+
 static int usage(char const program[static 1]) {
-  fprintf(stderr, "Usage: %s <config_file>\n", program);
+  fprintf(stderr, "Usage: %s [--verbose] [--scan] [--record <trace_file>] <config_file>\n", program);
   fprintf(stderr, "Example: %s /etc/growatt-exporter.conf\n", program);
+  fprintf(stderr, "  --verbose log debug messages, twice for trace messages too (SIGUSR1 cycles through levels)\n");
+  fprintf(stderr, "  --scan    discover the registers of the device and write modbus.capability_cache\n");
+  fprintf(stderr, "  --record  record every Modbus transaction into trace_file, see tests/mock-server.c to replay it\n");
   return EXIT_FAILURE;
 }
 
@@ -53,20 +83,124 @@ static int join_thread(thrd_t const *thread, char const label[static 1]) {
   keep_running = 0;
 }*/
 
-int parse_config(config *config, config_t *parser, char const *filename) {
+static bool lookup_string(config_t const *parser, char const path[static 1], char destination[static CONFIG_STRING_SIZE]) {
+  const char *value = NULL;
+  if (CONFIG_TRUE != config_lookup_string(parser, path, &value)) {
+    return false;
+  }
+
+  if (strlcpy(destination, value, CONFIG_STRING_SIZE) >= CONFIG_STRING_SIZE) {
+    LOG(LOG_ERROR, "Setting '%s' is too long", path);
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Read "<block>.queue_policy" and "<block>.queue_depth", how the sink of that block is fed (see sink.h)
+ */
+static int lookup_queue(config_t const *parser, char const block[static 1], const SINK_POLICY fallback, SINK_POLICY *policy,
+                        int *depth) {
+  char path[CONFIG_STRING_SIZE];
+  char value[CONFIG_STRING_SIZE];
+
+  *policy = fallback;
+  snprintf(path, sizeof(path), "%s.queue_policy", block);
+  if (lookup_string(parser, path, value) && sink_parse_policy(value, policy)) {
+    LOG(LOG_ERROR, "Invalid '%s' setting, expected \"drop_oldest\", \"coalesce\" or \"block\"", path);
+    return EXIT_FAILURE;
+  }
+
+  snprintf(path, sizeof(path), "%s.queue_depth", block);
+  if (CONFIG_TRUE != config_lookup_int(parser, path, depth)) {
+    *depth = SINK_QUEUE_DEPTH;
+  }
+  if (*depth < 1 || *depth > (int)SINK_QUEUE_SIZE) {
+    LOG(LOG_ERROR, "Invalid '%s' setting, between 1 and %u", path, SINK_QUEUE_SIZE);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+static int parse_settings(config *config, config_t *parser, char const *filename) {
   if (!config_read_file(parser, filename)) {
     LOG(LOG_ERROR, "%s:%d - %s\n", config_error_file(parser), config_error_line(parser), config_error_text(parser));
     return EXIT_FAILURE;
   }
 
-  if (CONFIG_TRUE != config_lookup_string(parser, "device_or_uri", &config->device_or_uri)) {
+  if (!lookup_string(parser, "device_or_uri", config->modbus_config.device_or_uri)) {
     LOG(LOG_ERROR, "No 'device_or_uri' setting in configuration file");
     return EXIT_FAILURE;
   }
 
+  if (CONFIG_TRUE != config_lookup_int(parser, "modbus.response_timeout_min", &config->modbus_config.response_timeout_min)) {
+    config->modbus_config.response_timeout_min = MODBUS_RESPONSE_TIMEOUT_MIN;
+  }
+
+  if (CONFIG_TRUE != config_lookup_int(parser, "modbus.response_timeout_max", &config->modbus_config.response_timeout_max)) {
+    config->modbus_config.response_timeout_max = MODBUS_RESPONSE_TIMEOUT_MAX;
+  }
+
+  if (config->modbus_config.response_timeout_min < 1 ||
+      config->modbus_config.response_timeout_min > config->modbus_config.response_timeout_max) {
+    LOG(LOG_ERROR, "Invalid 'modbus.response_timeout_min' and 'modbus.response_timeout_max' settings");
+    return EXIT_FAILURE;
+  }
+
+  if (CONFIG_TRUE != config_lookup_int(parser, "modbus.refresh_period", &config->modbus_config.refresh_period)) {
+    config->modbus_config.refresh_period = REFRESH_PERIOD;
+  }
+
+  if (config->modbus_config.refresh_period < 1) {
+    LOG(LOG_ERROR, "Invalid 'modbus.refresh_period' setting");
+    return EXIT_FAILURE;
+  }
+
+  if (CONFIG_TRUE != config_lookup_int(parser, "modbus.max_age", &config->modbus_config.max_age)) {
+    config->modbus_config.max_age = 0;
+  }
+
+  const config_setting_t *slave_ids = config_lookup(parser, "modbus.slave_ids");
+  if (slave_ids) {
+    const int count = config_setting_length(slave_ids);
+    if (!config_setting_is_array(slave_ids) || count < 1 || count > (int)MODBUS_MAX_SLAVES) {
+      LOG(LOG_ERROR, "'modbus.slave_ids' must be an array of 1 to %u slave ids", MODBUS_MAX_SLAVES);
+      return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < count; i++) {
+      const int slave_id = config_setting_get_int_elem(slave_ids, i);
+      if (slave_id < 1 || slave_id > MODBUS_MAX_SLAVE_ID) {
+        LOG(LOG_ERROR, "Invalid slave id %d in 'modbus.slave_ids'", slave_id);
+        return EXIT_FAILURE;
+      }
+      config->modbus_config.slave_ids[i] = slave_id;
+    }
+    config->modbus_config.slave_count = count;
+  }
+
+  lookup_string(parser, "modbus.capability_cache", config->modbus_config.capability_cache);
+
+  if (CONFIG_TRUE != config_lookup_int(parser, "modbus.metric_ttl", &config->modbus_config.metric_ttl)) {
+    // long enough for a cycle or two to fail, including in on-demand mode where cycles are max_age apart
+    const int period = config->modbus_config.max_age > config->modbus_config.refresh_period ? config->modbus_config.max_age
+                                                                                           : config->modbus_config.refresh_period;
+    config->modbus_config.metric_ttl = METRIC_TTL_PERIODS * period;
+  }
+
+  if (config->modbus_config.metric_ttl < 0) {
+    LOG(LOG_ERROR, "Invalid 'modbus.metric_ttl' setting");
+    return EXIT_FAILURE;
+  }
+
   if (CONFIG_TRUE != config_lookup_int(parser, "prometheus.port", &config->prometheus_config.port)) {
     config->prometheus_config.port = 0;
   }
+  if (CONFIG_TRUE != config_lookup_bool(parser, "prometheus.allow_commands", &config->prometheus_config.allow_commands)) {
+    config->prometheus_config.allow_commands = 0;
+  }
 
   if (CONFIG_TRUE != config_lookup_int(parser, "mqtt.port", &config->mqtt_config.port)) {
     config->mqtt_config.port = 0;
@@ -76,69 +210,280 @@ int parse_config(config *config, config_t *parser, char const *filename) {
     config->mqtt_config.id = 0;
   }
 
-  config_lookup_string(parser, "mqtt.host", &config->mqtt_config.host);
-  config_lookup_string(parser, "mqtt.username", &config->mqtt_config.username);
-  config_lookup_string(parser, "mqtt.password", &config->mqtt_config.password);
+  if (CONFIG_TRUE != config_lookup_bool(parser, "mqtt.stream", &config->mqtt_config.stream)) {
+    config->mqtt_config.stream = 0;
+  }
+
+  if (CONFIG_TRUE != config_lookup_bool(parser, "mqtt.allow_commands", &config->mqtt_config.allow_commands)) {
+    config->mqtt_config.allow_commands = 0;
+  }
+
+  if (CONFIG_TRUE != config_lookup_bool(parser, "event_loop", &config->event_loop)) {
+    config->event_loop = 0;
+  }
+
+  lookup_string(parser, "state_file", config->state_file);
+  lookup_string(parser, "span_file", config->span_file);
+  lookup_string(parser, "shm_name", config->shm_name);
+  lookup_string(parser, "mqtt.host", config->mqtt_config.host);
+  lookup_string(parser, "mqtt.username", config->mqtt_config.username);
+  lookup_string(parser, "mqtt.password", config->mqtt_config.password);
+
+  influx_config *influx = &config->influx_config;
+  if (CONFIG_TRUE != config_lookup_int(parser, "influxdb.port", &influx->port)) {
+    influx->port = 0;
+  }
+  if (!lookup_string(parser, "influxdb.host", influx->host)) {
+    strlcpy(influx->host, "localhost", CONFIG_STRING_SIZE);
+  }
+  if (!lookup_string(parser, "influxdb.path", influx->path)) {
+    strlcpy(influx->path, "/write?db=growatt&precision=ns", CONFIG_STRING_SIZE);
+  }
+  lookup_string(parser, "influxdb.token", influx->token);
+  if (CONFIG_TRUE != config_lookup_bool(parser, "influxdb.udp", &influx->udp)) {
+    influx->udp = 0;
+  }
+  if (CONFIG_TRUE != config_lookup_bool(parser, "influxdb.gzip", &influx->gzip)) {
+    influx->gzip = 1;
+  }
+  if (CONFIG_TRUE != config_lookup_int(parser, "influxdb.batch", &influx->batch)) {
+    influx->batch = INFLUX_BATCH;
+  }
+
+  if (influx->port && (influx->port > USHRT_MAX || influx->batch < 1)) {
+    LOG(LOG_ERROR, "Invalid 'influxdb.port' or 'influxdb.batch' setting");
+    return EXIT_FAILURE;
+  }
+
+  // the HTTP server and MQTT only need the latest values, InfluxDB wants every one of them
+  if (lookup_queue(parser, "prometheus", SINK_COALESCE, &config->prometheus_config.queue_policy,
+                   &config->prometheus_config.queue_depth) ||
+      lookup_queue(parser, "mqtt", SINK_COALESCE, &config->mqtt_config.queue_policy, &config->mqtt_config.queue_depth) ||
+      lookup_queue(parser, "influxdb", SINK_DROP_OLDEST, &influx->queue_policy, &influx->queue_depth)) {
+    return EXIT_FAILURE;
+  }
+
+  if (!config->prometheus_config.port && !config->mqtt_config.port && !influx->port) {
+    LOG(LOG_ERROR, "You must configure at least Prometheus, MQTT or InfluxDB");
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Parse the configuration file, settings are copied so the parser does not outlive this call
+ */
+int parse_config(config *config, char const filename[static 1]) {
+  memset(config, 0, sizeof(*config)); // so that configurations can be compared with memcmp()
+  config->filename = filename;
+
+  config_t parser;
+  config_init(&parser);
+  const int code = parse_settings(config, &parser, filename);
+  config_destroy(&parser);
+
+  return code;
+}
+
+/**
+ * Parse the configuration file again and hand the sections which changed over to their subsystems.
+ * Nothing is applied unless the whole file is valid.
+ */
+static int reload_config(void *context) {
+  config *current = (config *)context;
+  config next;
+
+  LOG(LOG_INFO, "Reloading %s...", current->filename);
+
+  if (parse_config(&next, current->filename)) {
+    LOG(LOG_ERROR, "Invalid configuration, keeping the current one");
+    return EXIT_FAILURE;
+  }
+
+  if (next.event_loop != current->event_loop || !next.prometheus_config.port != !current->prometheus_config.port ||
+      !next.mqtt_config.port != !current->mqtt_config.port || !next.influx_config.port != !current->influx_config.port ||
+      strcmp(next.state_file, current->state_file) != 0 || strcmp(next.shm_name, current->shm_name) != 0) {
+    LOG(LOG_ERROR, "Enabling or disabling a subsystem requires a restart, keeping the current configuration");
+    return EXIT_FAILURE;
+  }
+
+  // sections a subsystem could not switch to last time are offered again
+  if (reload_rejected(&modbus_reload) || memcmp(&next.modbus_config, &current->modbus_config, sizeof(modbus_config))) {
+    reload_modbus(&next.modbus_config);
+  }
+  if (reload_rejected(&prometheus_reload) || memcmp(&next.prometheus_config, &current->prometheus_config, sizeof(prometheus_config))) {
+    reload_prometheus(&next.prometheus_config);
+  }
+  if (reload_rejected(&mqtt_reload) || memcmp(&next.mqtt_config, &current->mqtt_config, sizeof(mqtt_config))) {
+    reload_mqtt(&next.mqtt_config);
+  }
+  if (memcmp(&next.influx_config, &current->influx_config, sizeof(influx_config))) {
+    reload_influx(&next.influx_config);
+  }
+  if (strcmp(next.span_file, current->span_file) != 0) {
+    init_spans(next.span_file);
+  }
+
+  *current = next;
 
   return EXIT_SUCCESS;
 }
 
+static void reload_handler(int signal) { // NOLINT(misc-unused-parameters)
+  reload_requested = 1;
+  sem_post(&supervisor);
+}
+
+static void verbosity_handler(int signal) { // NOLINT(misc-unused-parameters)
+  log_cycle_level();
+}
+
+static void spans_handler(int signal) { // NOLINT(misc-unused-parameters)
+  spans_requested = 1;
+  sem_post(&supervisor);
+}
+
+static int run_modbus_thread(void *config_ptr) {
+  const int value = start_modbus_thread(config_ptr); // which saves the state of the device it polled last
+  keep_running = 0;
+  sem_post(&supervisor); // let main() join threads
+  return value;
+}
+
 int main(int argc, char *argv[argc + 1]) {
   static_assert(__STDC_VERSION__ >= STDC_VERSION_MIN, "C17+ required");
 
-  // disable log buffering
-  setbuf(stdout, NULL);
-  setbuf(stderr, NULL);
-
   // signal(SIGINT, sig_handler);
 
-  if (argc < 2) {
+  bool scan = false;
+  char const *record = NULL;
+  int level = LOG_INFO;
+  int arg = 1;
+  for (; arg < argc - 1; arg++) {
+    if (!strcmp(argv[arg], "--verbose")) {
+      level = level > LOG_TRACE ? level - 1 : LOG_TRACE;
+    } else if (!strcmp(argv[arg], "--scan")) {
+      scan = true;
+    } else if (!strcmp(argv[arg], "--record") && arg + 2 < argc) {
+      record = argv[++arg];
+    } else {
+      return usage(argv[0]);
+    }
+  }
+  if (arg != argc - 1) {
     return usage(argv[0]);
   }
 
+  log_init(level);
+  stack_track("MAIN");
+
   config config;
-  config_t parser_config;
-  config_init(&parser_config);
-  if (parse_config(&config, &parser_config, argv[1])) {
-    config_destroy(&parser_config);
+  if (parse_config(&config, argv[arg])) {
+    return EXIT_FAILURE;
+  }
+
+  if (record && trace_open(record)) {
+    PERROR("Cannot write trace file %s", record);
+    return EXIT_FAILURE;
+  }
+
+  if (scan) {
+    return init_modbus(&config.modbus_config) || scan_modbus(&config.modbus_config) ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+  stack_reserve(STACK_SIZE_DEFAULT);
+  init_spans(config.span_file);
+
+  // the event loop reads these signals from a signalfd, which only works if every thread blocks them
+  if (config.event_loop && block_signals(NULL)) {
+    PERROR("pthread_sigmask() failed");
+    return EXIT_FAILURE;
+  }
+
+  if (log_start()) {
+    PERROR("Cannot start log writer, logging synchronously");
+  }
+
+  // sinks first, so that they get the metrics restored from the state file
+  if (init_prometheus(&config.prometheus_config) || init_mqtt(&config.mqtt_config) || init_influx(&config.influx_config) ||
+      init_shm(config.shm_name) || init_modbus(&config.modbus_config) || init_state(config.state_file, &config.modbus_config)) {
     return EXIT_FAILURE;
   }
 
+  if (config.event_loop) {
+    int value = run_event_loop(&config.modbus_config, &config.prometheus_config, &config.mqtt_config, &config.influx_config,
+                               reload_config, &config);
+    stack_report();
+    LOG(LOG_INFO, "Bye");
+    return value;
+  }
+
+  if (sem_init(&supervisor, 0, 0)) {
+    PERROR("sem_init() failed");
+    return EXIT_FAILURE;
+  }
+  signal(SIGHUP, reload_handler);
+  signal(SIGUSR1, verbosity_handler);
+  signal(SIGUSR2, spans_handler);
+
   thrd_t prometheus_thread = 0;
   thrd_t mqtt_thread = 0;
+  thrd_t influx_thread = 0;
+  thrd_t shm_thread = 0;
   thrd_t modbus_thread = 0;
 
   if (config.prometheus_config.port) {
-    int status = thrd_create(&prometheus_thread, (thrd_start_t)start_prometheus_thread, &config.prometheus_config);
+    int status = stack_thread(&prometheus_thread, (thrd_start_t)start_prometheus_thread, &config.prometheus_config, "PRMT",
+                              STACK_SIZE_PROMETHEUS);
     if (status != thrd_success) {
       PERROR("thrd_create() failed");
-      config_destroy(&parser_config);
       return EXIT_FAILURE;
     }
   }
 
   if (config.mqtt_config.port) {
-    int status = thrd_create(&mqtt_thread, (thrd_start_t)start_mqtt_thread, &config.mqtt_config);
+    int status = stack_thread(&mqtt_thread, (thrd_start_t)start_mqtt_thread, &config.mqtt_config, "MQTT", STACK_SIZE_MQTT);
     if (status != thrd_success) {
       PERROR("thrd_create() failed");
-      config_destroy(&parser_config);
       return EXIT_FAILURE;
     }
   }
 
-  if (!prometheus_thread && !mqtt_thread) {
-    LOG(LOG_ERROR, "You must configure at least Prometheus or MQTT (or both)");
-    config_destroy(&parser_config);
-    return EXIT_FAILURE;
+  if (config.influx_config.port) {
+    int status = stack_thread(&influx_thread, (thrd_start_t)start_influx_thread, &config.influx_config, "INFX", STACK_SIZE_INFLUX);
+    if (status != thrd_success) {
+      PERROR("thrd_create() failed");
+      return EXIT_FAILURE;
+    }
   }
 
-  int status = thrd_create(&modbus_thread, (thrd_start_t)start_modbus_thread, (void *)config.device_or_uri);
+  if (shm_segment) {
+    int status = stack_thread(&shm_thread, start_shm_thread, NULL, "SHMW", STACK_SIZE_SHM);
+    if (status != thrd_success) {
+      PERROR("thrd_create() failed");
+      return EXIT_FAILURE;
+    }
+  }
+
+  int status = stack_thread(&modbus_thread, run_modbus_thread, &config.modbus_config, "MDBS", STACK_SIZE_MODBUS);
   if (status != thrd_success) {
     PERROR("thrd_create() failed");
-    config_destroy(&parser_config);
     return EXIT_FAILURE;
   }
 
+  // sleep until either SIGHUP or the Modbus thread is done
+  while (keep_running) {
+    if (sem_wait(&supervisor) == 0 && reload_requested) {
+      reload_requested = 0;
+      reload_config(&config);
+    }
+    if (spans_requested) {
+      spans_requested = 0;
+      span_dump_file();
+    }
+  }
+
   // FIXME: catch MQTT thread termination somehow
   int value = join_thread(&modbus_thread, "MDBS");
 
@@ -148,9 +493,14 @@ int main(int argc, char *argv[argc + 1]) {
   if (mqtt_thread) {
     value += join_thread(&mqtt_thread, "MQTT");
   }
+  if (influx_thread) {
+    value += join_thread(&influx_thread, "INFX");
+  }
+  if (shm_thread) {
+    value += join_thread(&shm_thread, "SHMW");
+  }
 
-  config_destroy(&parser_config);
-
+  stack_report();
   LOG(LOG_INFO, "Bye");
   exit(value); // will terminate any remaining threads
 }
@@ -2,13 +2,41 @@
 #define GROWATT_GROWATT_H
 
 #include <inttypes.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#ifdef GROWATT_COMPACT
+#include <string.h> // strlcpy() and strlcat() from the C library (musl, glibc >= 2.38) rather than libbsd
+#else
+#include <bsd/string.h>
+#endif
 
 #define COUNT(x) (sizeof(x) / sizeof((x)[0])) // NOLINT(bugprone-sizeof-expression)
 
 // NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
 static volatile sig_atomic_t keep_running = 1;
 
+/**
+ * Block the signals main() and the event loop handle (exit, reload, verbosity and spans) in the calling thread, and thus
+ * in the threads it creates from now on. Fills signals with them unless NULL.
+ */
+static inline int block_signals(sigset_t *signals) {
+  sigset_t handled;
+  sigemptyset(&handled);
+  sigaddset(&handled, SIGINT);
+  sigaddset(&handled, SIGTERM);
+  sigaddset(&handled, SIGHUP);
+  sigaddset(&handled, SIGUSR1);
+  sigaddset(&handled, SIGUSR2);
+  if (signals) {
+    *signals = handled;
+  }
+
+  return pthread_sigmask(SIG_BLOCK, &handled, NULL) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
 enum {
   CLOCK_OFFSET_THRESHOLD = 30, // seconds
   EXIT_NO_METRICS = 4,
@@ -18,27 +46,52 @@ enum {
   REGISTER_CLOCK_YEAR_OFFSET = -1900, // years
 };
 
-typedef struct __attribute__((aligned(MAX_METRIC_LENGTH * 2))) {
+/**
+ * Declarative sanity checks applied to every value read, zeroed fields are disabled
+ */
+typedef struct {
+  /** Lower bound, only checked when max > min */
+  double min;
+  /** Upper bound, only checked when max > min */
+  double max;
+  /** Maximum change per second compared to the last accepted value, only checked when > 0 */
+  double max_rate;
+  /** Reject values lower than the last accepted one (counters which never reset) */
+  bool monotonic;
+} CHECK;
+
+/**
+ * Strings point to literals, which the linker pools so that e.g. "measurement" is stored once for all registers
+ */
+typedef struct {
   uint8_t address;
-  char human_name[MAX_METRIC_LENGTH];
-  char metric_name[MAX_METRIC_LENGTH];
+  const char *human_name;
+  /** Shorter than MAX_METRIC_LENGTH */
+  const char *metric_name;
   // https://developers.home-assistant.io/docs/core/entity/sensor/#available-device-classes
-  char device_class[MAX_METRIC_LENGTH];
+  const char *device_class;
   // unit of measurement e.g. "V" for voltage
-  char unit[MAX_METRIC_LENGTH];
+  const char *unit;
   // https://developers.home-assistant.io/docs/core/entity/sensor/#available-state-classes
-  char state_class[MAX_METRIC_LENGTH];
+  const char *state_class;
   enum { REGISTER_SINGLE, REGISTER_DOUBLE } register_size;
   double scale;
+  CHECK check;
+  /** Holding register which can be changed through commands, within its check range */
+  bool writable;
 } REGISTER;
 
 const REGISTER holding_registers[] = {
     // NOLINTBEGIN(readability-magic-numbers)
     {30, "communication address", "settings_communication_address", "", "", "measurement", REGISTER_SINGLE, 1},
-    {34, "max charging current", "settings_max_charging_amps", "current", "A", "measurement", REGISTER_SINGLE, 1},
-    {35, "bulk charging voltage", "settings_bulk_charging_volts", "voltage", "V", "measurement", REGISTER_SINGLE, 0.1},
-    {36, "float charging voltage", "settings_float_charging_volts", "voltage", "V", "measurement", REGISTER_SINGLE, 0.1},
-    {37, "battery voltage switch to utility", "settings_switch_to_utility_volts", "voltage", "V", "measurement", REGISTER_SINGLE, 0.1},
+    {34, "max charging current", "settings_max_charging_amps", "current", "A", "measurement", REGISTER_SINGLE, 1, {.min = 0, .max = 200},
+     true},
+    {35, "bulk charging voltage", "settings_bulk_charging_volts", "voltage", "V", "measurement", REGISTER_SINGLE, 0.1,
+     {.min = 10, .max = 64}, true},
+    {36, "float charging voltage", "settings_float_charging_volts", "voltage", "V", "measurement", REGISTER_SINGLE, 0.1,
+     {.min = 10, .max = 64}, true},
+    {37, "battery voltage switch to utility", "settings_switch_to_utility_volts", "voltage", "V", "measurement", REGISTER_SINGLE, 0.1,
+     {.min = 10, .max = 64}, true},
     // {76, "rated active power", "rated_active_power_watts"}, // XXX: not needed
     // {78, "rated apparant power", "rated_apparant_power_va"}, // XXX: not needed
     // NOLINTEND(readability-magic-numbers)
@@ -55,16 +108,19 @@ const REGISTER input_registers[] = {
     {11, "inverter apparant power", "inverter_apparant_power_va", "apparent_power", "VA", "measurement", REGISTER_DOUBLE, 0.1},
     {13, "grid charging power", "grid_charging_watts", "power", "W", "measurement", REGISTER_DOUBLE, 0.1},
     {17, "battery voltage", "battery_volts", "voltage", "V", "measurement", REGISTER_SINGLE, 0.01},
-    {18, "battery SOC", "battery_soc", "battery", "%", "measurement", REGISTER_SINGLE, 1},
+    {18, "battery SOC", "battery_soc", "battery", "%", "measurement", REGISTER_SINGLE, 1, {.min = 0, .max = 100}},
     // {19, "bus voltage", "bus_volts"}, // irrelevant
     {20, "grid voltage", "grid_volts", "voltage", "V", "measurement", REGISTER_SINGLE, 0.1},
-    {21, "grid frequency", "grid_hz", "frequency", "Hz", "measurement", REGISTER_SINGLE, 0.01},
+    {21, "grid frequency", "grid_hz", "frequency", "Hz", "measurement", REGISTER_SINGLE, 0.01, {.min = 0, .max = 70}},
     // {24, "output DC voltage", "output_dc_volts", "voltage", "V", "measurement", REGISTER_SINGLE, 0.1}, // XXX: always zero
-    {25, "inverter temperature", "temperature_inverter_celsius", "temperature", "°C", "measurement", REGISTER_SINGLE, 0.1},
-    {26, "DC-DC temperature", "temperature_dcdc_celsius", "temperature", "°C", "measurement", REGISTER_SINGLE, 0.1},
+    {25, "inverter temperature", "temperature_inverter_celsius", "temperature", "°C", "measurement", REGISTER_SINGLE, 0.1,
+     {.min = -40, .max = 150}},
+    {26, "DC-DC temperature", "temperature_dcdc_celsius", "temperature", "°C", "measurement", REGISTER_SINGLE, 0.1,
+     {.min = -40, .max = 150}},
     {27, "inverter load percent", "inverter_load_percent", "", "%", "measurement", REGISTER_SINGLE, 0.1},
     // {30, "work time total", "work_time_total_seconds", REGISTER_DOUBLE, 0.5}, // XXX: always zero
-    {32, "buck1 temperature", "temperature_buck1_celsius", "temperature", "°C", "measurement", REGISTER_SINGLE, 0.1},
+    {32, "buck1 temperature", "temperature_buck1_celsius", "temperature", "°C", "measurement", REGISTER_SINGLE, 0.1,
+     {.min = -40, .max = 150}},
     // {33, "buck2 temperature", "temperature_buck2_celsius", REGISTER_SINGLE, 0.1}, // irrelevant
     {34, "output current", "output_amps", "current", "A", "measurement", REGISTER_SINGLE, 0.1},
     {35, "inverter current", "inverter_amps", "current", "A", "measurement", REGISTER_SINGLE, 0.1},
@@ -76,13 +132,17 @@ const REGISTER input_registers[] = {
     // {46, "production line mode", "production_line_mode", REGISTER_SINGLE, 1}, // XXX: always zero
     // {47, "constant power OK flag", "constant_power_ok_flag", REGISTER_SINGLE, 1}, // XXX: always zero
     {48, "PV energy today", "energy_pv_today_kwh", "energy", "kWh", "total_increasing", REGISTER_DOUBLE, 0.1},
-    {50, "PV energy total", "energy_pv_total_kwh", "energy", "kWh", "total_increasing", REGISTER_DOUBLE, 0.1},
+    {50, "PV energy total", "energy_pv_total_kwh", "energy", "kWh", "total_increasing", REGISTER_DOUBLE, 0.1,
+     {.min = 0.1, .max = 1e6, .max_rate = 0.01, .monotonic = true}},
     {56, "grid energy today", "energy_grid_today_kwh", "energy", "kWh", "total_increasing", REGISTER_DOUBLE, 0.1},
-    {58, "grid energy total", "energy_grid_total_kwh", "energy", "kWh", "total_increasing", REGISTER_DOUBLE, 0.1},
+    {58, "grid energy total", "energy_grid_total_kwh", "energy", "kWh", "total_increasing", REGISTER_DOUBLE, 0.1,
+     {.max_rate = 0.01, .monotonic = true}},
     {60, "battery discharging energy today", "battery_discharging_today_kwh", "energy", "kWh", "total_increasing", REGISTER_DOUBLE, 0.1},
-    {62, "battery discharging energy total", "battery_discharging_total_kwh", "energy", "kWh", "total_increasing", REGISTER_DOUBLE, 0.1},
+    {62, "battery discharging energy total", "battery_discharging_total_kwh", "energy", "kWh", "total_increasing", REGISTER_DOUBLE, 0.1,
+     {.max_rate = 0.01, .monotonic = true}},
     {64, "grid discharging energy today", "grid_discharging_today_kwh", "energy", "kWh", "total_increasing", REGISTER_DOUBLE, 0.1},
-    {66, "grid discharging energy total", "grid_discharging_total_kwh", "energy", "kWh", "total_increasing", REGISTER_DOUBLE, 0.1},
+    {66, "grid discharging energy total", "grid_discharging_total_kwh", "energy", "kWh", "total_increasing", REGISTER_DOUBLE, 0.1,
+     {.max_rate = 0.01, .monotonic = true}},
     {68, "grid charging current", "grid_charging_amps", "current", "A", "measurement", REGISTER_SINGLE, 0.1},
     {69, "inverter discharging power", "inverter_discharging_watts", "power", "W", "measurement", REGISTER_DOUBLE, 0.1},
     {73, "battery discharging power", "battery_discharging_watts", "power", "W", "measurement", REGISTER_DOUBLE, 0.1},
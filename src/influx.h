@@ -0,0 +1,411 @@
+#ifndef GROWATT_INFLUX_H
+#define GROWATT_INFLUX_H
+
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <threads.h>
+#include <time.h>
+#include <unistd.h> // close()
+#include <zlib.h>
+
+#include "log.h"
+#include "modbus.h"
+#include "reload.h"
+#include "sink.h"
+
+#undef LOG_TAG
+#define LOG_TAG "92m[INFX] "
+
+enum {
+  INFLUX_BUFFER_MAX = 1024U * 1024U, // bytes of line protocol kept while the server cannot be reached
+  INFLUX_BACKOFF_MAX = 300,          // seconds in between two attempts at most
+  INFLUX_TIMEOUT = 5,                // seconds to connect, send and get the response
+  INFLUX_DATAGRAM_SIZE = 1400U,      // bytes, so that datagrams are not fragmented
+  INFLUX_LINE_SIZE = 4096U,
+  INFLUX_HEADER_SIZE = 1024U,
+  INFLUX_GZIP_WINDOW = 15 + 16, // deflate window bits, +16 for a gzip wrapper
+  INFLUX_GZIP_MEMORY = 8,
+  INFLUX_WAIT = 1000, // ms in between two checks for reloads, exits and retries
+};
+
+typedef struct {
+  char host[CONFIG_STRING_SIZE];
+  int port;
+  /** HTTP path and query string, e.g. "/api/v2/write?org=home&bucket=solar&precision=ns" */
+  char path[CONFIG_STRING_SIZE];
+  /** Sent as "Authorization: Token <token>" (optional) */
+  char token[CONFIG_STRING_SIZE];
+  /** Send datagrams to a UDP listener instead of HTTP requests */
+  int udp;
+  /** Number of cycles written at once */
+  int batch;
+  /** Compress HTTP requests */
+  int gzip;
+  SINK_POLICY queue_policy;
+  int queue_depth;
+} influx_config;
+
+typedef enum {
+  INFLUX_WRITTEN = EXIT_SUCCESS,
+  INFLUX_RETRY,    // the server could not be reached or is unavailable, keep the lines
+  INFLUX_REJECTED, // the server refused the lines, sending them again would not help
+} INFLUX_RESULT;
+
+/**
+ * Line protocol waiting to be written, belongs to the thread owning the sink
+ */
+typedef struct {
+  char *lines;
+  size_t size;
+  /** Cycles encoded since the last write */
+  int cycles;
+  /** refresh.cycles when the last cycle was counted */
+  unsigned long encoded_cycle;
+  /** Last snapshot of each unit encoded, samples which did not change since then are not encoded again */
+  SNAPSHOT *encoded[MODBUS_MAX_SLAVES];
+  /** Seconds to wait after a failed write, doubled each time */
+  int backoff;
+  time_t retry_at;
+  size_t dropped_lines_total;
+} INFLUX;
+
+// NOLINTBEGIN(cppcoreguidelines-avoid-non-const-global-variables)
+static INFLUX influx;
+static influx_config influx_pending;
+static RELOAD influx_reload;
+static SINK influx_sink = {.wakeup = -1};
+// NOLINTEND(cppcoreguidelines-avoid-non-const-global-variables)
+
+int init_influx(const influx_config *config) {
+  if (config->port && sink_open(&influx_sink, "influxdb", config->queue_policy, config->queue_depth)) {
+    return EXIT_FAILURE;
+  }
+
+  return reload_init(&influx_reload, &influx_pending, sizeof(influx_pending));
+}
+
+/**
+ * Hand a new configuration over to the thread owning the sink
+ */
+void reload_influx(const influx_config *config) { reload_offer(&influx_reload, config); }
+
+static size_t count_lines(const char *lines, const size_t size) {
+  size_t count = 0;
+  for (size_t i = 0; i < size; i++) {
+    count += lines[i] == '\n';
+  }
+  return count;
+}
+
+/**
+ * Append lines to the buffer, dropping the oldest lines once it is full
+ */
+static void influx_append(char const line[static 1], const size_t length) {
+  if (influx.size + length > INFLUX_BUFFER_MAX) {
+    const char *start = influx.lines + (influx.size + length - INFLUX_BUFFER_MAX);
+    const char *end = influx.lines + influx.size;
+    while (start < end && start[-1] != '\n') {
+      start++;
+    }
+
+    influx.dropped_lines_total += count_lines(influx.lines, (size_t)(start - influx.lines));
+    LOG(LOG_ERROR, "InfluxDB buffer full, dropped %zu lines so far", influx.dropped_lines_total);
+
+    influx.size = (size_t)(end - start);
+    memmove(influx.lines, start, influx.size);
+  }
+
+  if (influx.lines == NULL && (influx.lines = malloc(INFLUX_BUFFER_MAX)) == NULL) {
+    PERROR("malloc failed");
+    exit(errno);
+  }
+
+  memcpy(influx.lines + influx.size, line, length);
+  influx.size += length;
+}
+
+/**
+ * Encode the samples of snapshot read since the previous one of its unit as line protocol, one line per read request:
+ * "growatt[,slave=<slave_id>] <metric_name>=<value>,... <nanosecond timestamp>"
+ */
+static void influx_encode(const SNAPSHOT *snapshot, const SNAPSHOT *previous) {
+  const int64_t now = realtime_ms();
+  char line[INFLUX_LINE_SIZE];
+  char field[METRIC_BUFFER_SIZE * 2];
+  size_t length = 0;
+  int64_t at = 0;
+
+  for (size_t i = 0; i <= snapshot->size; i++) {
+    const METRIC *metric = i < snapshot->size ? &snapshot->metrics[i] : NULL;
+    if (metric && (!snapshot_fresh(previous, metric, i) || metric_expired(metric, now))) {
+      continue;
+    }
+
+    // samples read by the same request share a timestamp, hence a line
+    if (length && (metric == NULL || metric->at != at || length + sizeof(field) >= sizeof(line))) {
+      length += (size_t)snprintf(line + length, sizeof(line) - length, " %" PRId64 "000000\n", at);
+      influx_append(line, length);
+      length = 0;
+    }
+    if (metric == NULL) {
+      break;
+    }
+
+    if (length == 0) {
+      at = metric->at;
+      length = atomic_load(&slave_count) > 1 ? (size_t)snprintf(line, sizeof(line), "growatt,slave=%d ", snapshot->slave_id)
+                                             : strlcpy(line, "growatt ", sizeof(line));
+    } else {
+      line[length++] = ',';
+    }
+    snprintf(field, sizeof(field), "%s=%lf", metric->name, metric->value);
+    length += strlcpy(line + length, field, sizeof(line) - length);
+  }
+}
+
+static int influx_connect(const influx_config *config) {
+  char port[sizeof("65535")];
+  snprintf(port, sizeof(port), "%d", config->port);
+
+  struct addrinfo *addresses = NULL;
+  const struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = config->udp ? SOCK_DGRAM : SOCK_STREAM};
+  const int error = getaddrinfo(config->host, port, &hints, &addresses);
+  if (error) {
+    LOG(LOG_ERROR, "Cannot resolve %s: %s", config->host, gai_strerror(error));
+    return -1;
+  }
+
+  int fd = -1;
+  const struct timeval timeout = {.tv_sec = INFLUX_TIMEOUT};
+  for (const struct addrinfo *address = addresses; address && fd < 0; address = address->ai_next) {
+    fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+    if (fd >= 0 && (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) ||
+                    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) ||
+                    connect(fd, address->ai_addr, address->ai_addrlen))) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(addresses);
+
+  if (fd < 0) {
+    PERROR("Cannot connect to %s:%d", config->host, config->port);
+  }
+
+  return fd;
+}
+
+static bool send_all(const int fd, const void *data, const size_t size) {
+  for (size_t sent = 0; sent < size;) {
+    const ssize_t written = send(fd, (const char *)data + sent, size - sent, MSG_NOSIGNAL);
+    if (written <= 0) {
+      return false;
+    }
+    sent += (size_t)written;
+  }
+
+  return true;
+}
+
+/**
+ * Compress size bytes of data into a gzip stream allocated into *compressed, returns its size (0 on failure)
+ */
+static size_t influx_gzip(const char *data, const size_t size, unsigned char **compressed) {
+  z_stream stream = {0};
+  if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, INFLUX_GZIP_WINDOW, INFLUX_GZIP_MEMORY, Z_DEFAULT_STRATEGY) != Z_OK) {
+    return 0;
+  }
+
+  const uLong bound = deflateBound(&stream, (uLong)size);
+  *compressed = malloc(bound);
+  stream.next_in = (Bytef *)data;
+  stream.avail_in = (uInt)size;
+  stream.next_out = *compressed;
+  stream.avail_out = (uInt)bound;
+
+  const bool finished = *compressed && deflate(&stream, Z_FINISH) == Z_STREAM_END;
+  const size_t compressed_size = finished ? stream.total_out : 0;
+  deflateEnd(&stream);
+
+  return compressed_size;
+}
+
+static INFLUX_RESULT influx_post(const influx_config *config) {
+  unsigned char *compressed = NULL;
+  const char *body = influx.lines;
+  size_t size = influx.size;
+
+  if (config->gzip) {
+    size = influx_gzip(influx.lines, influx.size, &compressed);
+    body = (const char *)compressed;
+    if (size == 0) {
+      LOG(LOG_ERROR, "Cannot compress %zu bytes", influx.size);
+      free(compressed);
+      return INFLUX_RETRY;
+    }
+  }
+
+  char header[INFLUX_HEADER_SIZE];
+  int length = snprintf(header, sizeof(header),
+                        "POST %s HTTP/1.1\r\nHost: %s:%d\r\nUser-Agent: growatt-exporter\r\nConnection: close\r\n"
+                        "Content-Type: text/plain; charset=utf-8\r\nContent-Length: %zu\r\n%s",
+                        config->path, config->host, config->port, size, config->gzip ? "Content-Encoding: gzip\r\n" : "");
+  if (config->token[0]) {
+    length += snprintf(header + length, sizeof(header) - (size_t)length, "Authorization: Token %s\r\n", config->token);
+  }
+  length += snprintf(header + length, sizeof(header) - (size_t)length, "\r\n");
+
+  const int fd = influx_connect(config);
+  bool sent = fd >= 0 && (size_t)length < sizeof(header) && send_all(fd, header, (size_t)length) && send_all(fd, body, size);
+  free(compressed);
+
+  char response[INFLUX_HEADER_SIZE] = {0};
+  int status = 0;
+  if (sent && (recv(fd, response, sizeof(response) - 1, 0) <= 0 || sscanf(response, "HTTP/1.%*d %d", &status) != 1)) {
+    sent = false;
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+
+  if (!sent) {
+    PERROR("Writing to InfluxDB %s:%d failed", config->host, config->port);
+    return INFLUX_RETRY;
+  }
+
+  if (status >= 200 && status < 300) { // NOLINT(readability-magic-numbers)
+    LOG(LOG_DEBUG, "Wrote %zu bytes (%zu on the wire) to InfluxDB", influx.size, size);
+    return INFLUX_WRITTEN;
+  }
+
+  LOG(LOG_ERROR, "InfluxDB answered: %.*s", (int)strcspn(response, "\r\n"), response);
+
+  // a server overloaded or timing out may take the same lines later, anything else in 4xx means they are invalid
+  return status >= 400 && status < 500 && status != 408 && status != 429 ? INFLUX_REJECTED : INFLUX_RETRY; // NOLINT
+}
+
+/**
+ * Send the lines as datagrams of whole lines, which a UDP listener parses on their own
+ */
+static INFLUX_RESULT influx_send_datagrams(const influx_config *config) {
+  const int fd = influx_connect(config);
+  if (fd < 0) {
+    return INFLUX_RETRY;
+  }
+
+  size_t start = 0;
+  while (start < influx.size) {
+    size_t end = start;
+    while (end < influx.size) {
+      const char *newline = memchr(influx.lines + end, '\n', influx.size - end);
+      const size_t next = newline ? (size_t)(newline - influx.lines) + 1 : influx.size;
+      if (end > start && next - start > INFLUX_DATAGRAM_SIZE) {
+        break;
+      }
+      end = next;
+    }
+
+    if (send(fd, influx.lines + start, end - start, MSG_NOSIGNAL) < 0) {
+      PERROR("Sending to InfluxDB %s:%d failed", config->host, config->port);
+      close(fd);
+      memmove(influx.lines, influx.lines + start, influx.size - start); // keep what was not sent
+      influx.size -= start;
+      return INFLUX_RETRY;
+    }
+    start = end;
+  }
+
+  close(fd);
+
+  return INFLUX_WRITTEN;
+}
+
+/**
+ * Write the buffered lines unless waiting after a failure, backing off exponentially while the server is unavailable
+ */
+int influx_flush(const influx_config *config) {
+  const time_t now = time(NULL);
+  if (influx.size == 0 || now < influx.retry_at) {
+    return EXIT_SUCCESS;
+  }
+
+  const uint64_t span = span_begin();
+  const INFLUX_RESULT result = config->udp ? influx_send_datagrams(config) : influx_post(config);
+  span_end(span, "influx_write", "bytes", (int)influx.size);
+  if (result == INFLUX_RETRY) {
+    influx.backoff = influx.backoff ? (influx.backoff * 2 < INFLUX_BACKOFF_MAX ? influx.backoff * 2 : INFLUX_BACKOFF_MAX) : 1;
+    influx.retry_at = now + influx.backoff;
+    LOG(LOG_ERROR, "Will write %zu bytes to InfluxDB again in %ds", influx.size, influx.backoff);
+    return EXIT_FAILURE;
+  }
+
+  if (result == INFLUX_REJECTED) {
+    influx.dropped_lines_total += count_lines(influx.lines, influx.size);
+    LOG(LOG_ERROR, "Dropping %zu bytes refused by InfluxDB", influx.size);
+  }
+
+  influx.size = 0;
+  influx.cycles = 0;
+  influx.backoff = 0;
+  influx.retry_at = 0;
+
+  return result == INFLUX_WRITTEN ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Encode the snapshots queued, then write once enough cycles are batched (or a failed write is due again).
+ * Called by the thread owning the sink.
+ */
+void influx_collect(const influx_config *config) {
+  SNAPSHOT *snapshot = NULL;
+  while ((snapshot = sink_take(&influx_sink))) {
+    influx_encode(snapshot, influx.encoded[snapshot->slave]);
+    snapshot_keep(influx.encoded, snapshot);
+  }
+
+  mtx_lock(&refresh.mutex);
+  const unsigned long cycles = refresh.cycles;
+  mtx_unlock(&refresh.mutex);
+
+  if (cycles != influx.encoded_cycle) {
+    influx.encoded_cycle = cycles;
+    influx.cycles++;
+  }
+
+  if (influx.cycles >= config->batch || (influx.retry_at && time(NULL) >= influx.retry_at)) {
+    influx_flush(config);
+  }
+}
+
+int start_influx_thread(void *config_ptr) {
+  span_thread("INFX");
+  block_signals(NULL); // left to the threads handling them
+  influx_config config = *(const influx_config *)config_ptr;
+  influx_config next;
+
+  LOG(LOG_INFO, "Writing to InfluxDB %s:%d every %d cycles", config.host, config.port, config.batch);
+
+  while (keep_running) {
+    sink_wait(&influx_sink, INFLUX_WAIT); // the timeout lets reloads and exits through
+
+    if (reload_take(&influx_reload, &next)) {
+      sink_configure(&influx_sink, next.queue_policy, next.queue_depth);
+      config = next;
+      LOG(LOG_INFO, "InfluxDB configuration reloaded");
+    }
+
+    influx_collect(&config);
+  }
+
+  influx.retry_at = 0;
+  influx_flush(&config); // last chance for what is left
+
+  return EXIT_SUCCESS;
+}
+
+#endif /* GROWATT_INFLUX_H */
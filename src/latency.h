@@ -0,0 +1,73 @@
+#ifndef GROWATT_LATENCY_H
+#define GROWATT_LATENCY_H
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+  LATENCY_SAMPLES = 64U, // ring buffer size used to estimate percentiles
+};
+
+#define LATENCY_ALPHA 0.125 // EWMA gain for the mean (same as TCP's RTT estimator)
+#define LATENCY_BETA 0.25   // EWMA gain for the mean deviation
+#define LATENCY_PERCENTILE 0.99
+
+/**
+ * Running estimate of transaction latency, all values in milliseconds
+ */
+typedef struct {
+  double mean;
+  double deviation;
+  double samples[LATENCY_SAMPLES];
+  /** Number of samples recorded so far (for internal use) */
+  size_t count;
+} LATENCY;
+
+void latency_record(LATENCY *latency, const double sample) {
+  if (latency->count == 0) {
+    latency->mean = sample;
+    latency->deviation = sample / 2;
+  } else {
+    latency->deviation += LATENCY_BETA * (fabs(sample - latency->mean) - latency->deviation);
+    latency->mean += LATENCY_ALPHA * (sample - latency->mean);
+  }
+
+  latency->samples[latency->count++ % LATENCY_SAMPLES] = sample;
+}
+
+static int compare_doubles(const void *left, const void *right) {
+  const double a = *(const double *)left;
+  const double b = *(const double *)right;
+  return (a > b) - (a < b);
+}
+
+double latency_percentile(const LATENCY *latency, const double percentile) {
+  const size_t size = latency->count < LATENCY_SAMPLES ? latency->count : LATENCY_SAMPLES;
+  if (size == 0) {
+    return 0;
+  }
+
+  double sorted[LATENCY_SAMPLES];
+  memcpy(sorted, latency->samples, size * sizeof(double));
+  qsort(sorted, size, sizeof(double), compare_doubles);
+
+  return sorted[(size_t)(percentile * (double)(size - 1))];
+}
+
+/**
+ * Timeout covering both the usual jitter (mean + 4 deviations) and the tail (1.5 x p99), within bounds
+ */
+double latency_timeout(const LATENCY *latency, const double min, const double max) {
+  if (latency->count == 0) {
+    return max;
+  }
+
+  const double jitter = latency->mean + 4 * latency->deviation;               // NOLINT(readability-magic-numbers)
+  const double tail = 1.5 * latency_percentile(latency, LATENCY_PERCENTILE); // NOLINT(readability-magic-numbers)
+  const double timeout = jitter > tail ? jitter : tail;
+
+  return timeout < min ? min : (timeout > max ? max : timeout);
+}
+
+#endif /* GROWATT_LATENCY_H */
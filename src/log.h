@@ -1,9 +1,19 @@
 #ifndef GROWATT_LOG_H
 #define GROWATT_LOG_H
 
+#include <errno.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-
-#define LOG_VERBOSE 0 // compile with 1 to enable debug messages
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <threads.h>
+#include <time.h>
+#include <unistd.h>
 
 enum {
   LOG_TRACE,
@@ -12,29 +22,309 @@ enum {
   LOG_ERROR,
 };
 
-#define PERROR_HELPER(fmt, ...)                                                                                                            \
-  fprintf(stderr, "\x1b[37;41m" fmt ": %s%s\n\x1b[0m", __VA_ARGS__, strerror(errno)) // NOLINT(concurrency-mt-unsafe)
-#define PERROR(...) PERROR_HELPER(__VA_ARGS__, "")
+enum {
+  LOG_RING_SIZE = 256,                   // messages waiting for the writer
+  LOG_MESSAGE_SIZE = 512,                // bytes, longer messages are truncated
+  LOG_LINE_SIZE = LOG_MESSAGE_SIZE + 32, // room for the tag and the colors
+  LOG_BATCH_SIZE = 16 * LOG_LINE_SIZE,   // bytes written at once by the writer
+  LOG_LIMIT_PERIOD = 60,                 // s
+  LOG_LIMIT_BURST = 5,                   // errors logged by one call site per LOG_LIMIT_PERIOD
+  LOG_PRIORITY_ERROR = 3,                // syslog priorities understood by journald
+  LOG_PRIORITY_INFO = 6,
+  LOG_PRIORITY_DEBUG = 7,
+};
+
+/**
+ * Color and label of the subsystem logging, each file sets its own right after its #includes
+ */
+#ifndef LOG_TAG
+#define LOG_TAG "31m[????] "
+#endif
+
+typedef struct {
+  /** Position at which the slot can be claimed, or that position + 1 once its message is complete */
+  atomic_size_t sequence;
+  int level;
+  const char *tag;
+  char message[LOG_MESSAGE_SIZE];
+} LOG_SLOT;
+
+/**
+ * Rate limit of a single LOG() call site, so that an outage failing every request doesn't flood the logs
+ */
+typedef struct {
+  atomic_llong period; // start of the current period
+  atomic_uint count;   // messages during that period
+} LOG_LIMIT;
+
+typedef struct {
+  /** Multiple producers, one consumer at a time: the writer thread, a producer finding the ring full, or exit() */
+  LOG_SLOT slots[LOG_RING_SIZE];
+  atomic_size_t head;
+  size_t tail;
+  /** Until the writer thread runs (and in the tests), messages are written synchronously */
+  atomic_bool running;
+  /** Set by the writer before it blocks on wakeup, which producers then post to once their message is complete */
+  atomic_bool idle;
+  int wakeup;
+  /** Whether stdout/stderr go to journald, which wants "<priority>" prefixes rather than colors */
+  bool journal;
+  mtx_t writer_mutex;
+  thrd_t writer;
+} LOGGER;
+
+// NOLINTBEGIN(cppcoreguidelines-avoid-non-const-global-variables)
+static atomic_int log_level = LOG_INFO;
+static LOGGER logger;
+// NOLINTEND(cppcoreguidelines-avoid-non-const-global-variables)
+
+const char *log_level_name(const int level) {
+  static const char *const names[] = {[LOG_TRACE] = "trace", [LOG_DEBUG] = "debug", [LOG_INFO] = "info", [LOG_ERROR] = "error"};
+  return names[level];
+}
+
+void log_set_level(const int level) { atomic_store_explicit(&log_level, level, memory_order_relaxed); }
+
+/**
+ * info -> debug -> trace -> info, async-signal-safe (SIGUSR1)
+ */
+int log_cycle_level(void) {
+  const int level = atomic_load_explicit(&log_level, memory_order_relaxed);
+  const int next = level == LOG_TRACE ? LOG_INFO : level - 1;
+  atomic_store_explicit(&log_level, next, memory_order_relaxed);
+  return next;
+}
+
+static void log_write_all(const int fd, const char *buffer, size_t size) {
+  while (size > 0) {
+    const ssize_t written = write(fd, buffer, size);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return; // nowhere left to report it
+    }
+    buffer += written;
+    size -= (size_t)written;
+  }
+}
+
+/**
+ * Format a complete line, colored for a terminal or prefixed with its syslog priority for journald
+ */
+static size_t log_line(char line[static LOG_LINE_SIZE], const int level, char const tag[static 1], char const message[static 1]) {
+  int length = 0;
+  if (logger.journal) {
+    const int priority = level == LOG_ERROR ? LOG_PRIORITY_ERROR : level == LOG_INFO ? LOG_PRIORITY_INFO : LOG_PRIORITY_DEBUG;
+    length = snprintf(line, LOG_LINE_SIZE, "<%d>%s%s\n", priority, strchr(tag, 'm') + 1, message);
+  } else {
+    length = snprintf(line, LOG_LINE_SIZE, "\x1b[%s%s\x1b[0m\n", tag, message);
+  }
+
+  return length < 0 ? 0 : length < LOG_LINE_SIZE ? (size_t)length : LOG_LINE_SIZE - 1;
+}
+
+/**
+ * Write every complete message of the ring, grouping consecutive lines going to the same stream
+ */
+void log_drain(void) {
+  static char batch[LOG_BATCH_SIZE];
+
+  mtx_lock(&logger.writer_mutex);
+
+  size_t used = 0;
+  int fd = STDOUT_FILENO;
+  for (;;) {
+    LOG_SLOT *slot = &logger.slots[logger.tail % LOG_RING_SIZE];
+    if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != logger.tail + 1) {
+      break; // empty, or the next message is still being formatted
+    }
+
+    const int slot_fd = slot->level == LOG_ERROR ? STDERR_FILENO : STDOUT_FILENO;
+    if (slot_fd != fd || used + LOG_LINE_SIZE > sizeof(batch)) {
+      log_write_all(fd, batch, used);
+      used = 0;
+      fd = slot_fd;
+    }
+    used += log_line(batch + used, slot->level, slot->tag, slot->message);
+
+    atomic_store_explicit(&slot->sequence, logger.tail + LOG_RING_SIZE, memory_order_release);
+    logger.tail++;
+  }
+  log_write_all(fd, batch, used);
+
+  mtx_unlock(&logger.writer_mutex);
+}
+
+/**
+ * Whether the next message of the ring is complete
+ */
+static bool log_ready(void) {
+  mtx_lock(&logger.writer_mutex);
+  const LOG_SLOT *slot = &logger.slots[logger.tail % LOG_RING_SIZE];
+  const bool ready = atomic_load_explicit(&slot->sequence, memory_order_acquire) == logger.tail + 1;
+  mtx_unlock(&logger.writer_mutex);
+  return ready;
+}
+
+/**
+ * Sleeps until a producer completes a message, rather than waking up periodically
+ */
+static int log_writer(void *unused) { // NOLINT(misc-unused-parameters)
+  while (atomic_load_explicit(&logger.running, memory_order_relaxed)) {
+    log_drain();
 
-const char *log_prefix(const char filename[static 1]) {
-  if (!strcmp(filename, "src/growatt.c")) {
-    return "32m[GRWT]";
+    atomic_store(&logger.idle, true);
+    atomic_thread_fence(memory_order_seq_cst); // pairs with the one in log_write(): either sees the other's store
+    eventfd_t posts = 0;
+    if (!log_ready()) {
+      eventfd_read(logger.wakeup, &posts);
+    }
+    atomic_store(&logger.idle, false);
   }
-  if (!strcmp(filename, "src/mqtt.h")) {
-    return "33m[MQTT]";
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Claim the next free slot, returns NULL when the ring is full
+ */
+static LOG_SLOT *log_claim(size_t *position) {
+  size_t head = atomic_load_explicit(&logger.head, memory_order_relaxed);
+  for (;;) {
+    LOG_SLOT *slot = &logger.slots[head % LOG_RING_SIZE];
+    const size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    if (sequence == head) {
+      if (atomic_compare_exchange_weak_explicit(&logger.head, &head, head + 1, memory_order_relaxed, memory_order_relaxed)) {
+        *position = head;
+        return slot;
+      }
+    } else if ((ptrdiff_t)(sequence - head) < 0) {
+      return NULL; // still holding a message from the previous lap
+    } else {
+      head = atomic_load_explicit(&logger.head, memory_order_relaxed);
+    }
+  }
+}
+
+/**
+ * Count a message of a call site, false once it went off more than LOG_LIMIT_BURST times within LOG_LIMIT_PERIOD;
+ * suppressed is then set to how many were dropped during the previous period
+ */
+static bool log_allow(LOG_LIMIT *limit, unsigned *count, unsigned *suppressed) {
+  const long long now = (long long)time(NULL);
+  long long period = atomic_load_explicit(&limit->period, memory_order_relaxed);
+  if (now - period >= LOG_LIMIT_PERIOD && atomic_compare_exchange_strong(&limit->period, &period, now)) {
+    const unsigned previous = atomic_exchange(&limit->count, 1);
+    *suppressed = previous > LOG_LIMIT_BURST ? previous - LOG_LIMIT_BURST : 0;
+    *count = 1;
+    return true;
+  }
+
+  *count = atomic_fetch_add(&limit->count, 1) + 1;
+  return *count <= LOG_LIMIT_BURST;
+}
+
+__attribute__((format(printf, 4, 5))) void log_write(const int level, char const tag[static 1], LOG_LIMIT *limit,
+                                                     char const format[static 1], ...) {
+  unsigned count = 0;
+  unsigned suppressed = 0;
+  if (level == LOG_ERROR && !log_allow(limit, &count, &suppressed)) {
+    return;
+  }
+
+  char buffer[LOG_MESSAGE_SIZE];
+  size_t position = 0;
+  LOG_SLOT *slot = NULL;
+  const bool running = atomic_load_explicit(&logger.running, memory_order_acquire);
+  while (running && (slot = log_claim(&position)) == NULL) {
+    log_drain(); // the writer fell behind: rather than losing messages, write them from here
+  }
+
+  char *message = slot ? slot->message : buffer;
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(message, LOG_MESSAGE_SIZE, format, args);
+  va_end(args);
+
+  length = length < 0 ? 0 : length < LOG_MESSAGE_SIZE ? length : LOG_MESSAGE_SIZE - 1;
+  if (suppressed) {
+    snprintf(message + length, LOG_MESSAGE_SIZE - (size_t)length, " (%u more suppressed)", suppressed);
+  } else if (count == LOG_LIMIT_BURST) {
+    snprintf(message + length, LOG_MESSAGE_SIZE - (size_t)length, " (muted for up to %d s)", LOG_LIMIT_PERIOD);
+  }
+
+  if (slot == NULL) {
+    char line[LOG_LINE_SIZE];
+    log_write_all(level == LOG_ERROR ? STDERR_FILENO : STDOUT_FILENO, line, log_line(line, level, tag, message));
+    return;
+  }
+
+  slot->level = level;
+  slot->tag = tag;
+  atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&logger.idle, memory_order_relaxed) && atomic_exchange(&logger.idle, false)) {
+    eventfd_write(logger.wakeup, 1);
+  }
+}
+
+/**
+ * Whether systemd connected stderr to the journal, see systemd.exec(5)
+ */
+static bool log_to_journal(void) {
+  const char *stream = getenv("JOURNAL_STREAM"); // NOLINT(concurrency-mt-unsafe)
+  unsigned long long device = 0;
+  unsigned long long inode = 0;
+  struct stat status;
+
+  return stream && sscanf(stream, "%llu:%llu", &device, &inode) == 2 && !fstat(STDERR_FILENO, &status) && status.st_dev == device &&
+         status.st_ino == inode;
+}
+
+void log_init(const int level) {
+  log_set_level(level);
+  logger.journal = log_to_journal();
+  for (size_t i = 0; i < LOG_RING_SIZE; i++) {
+    atomic_init(&logger.slots[i].sequence, i);
   }
-  if (!strcmp(filename, "src/modbus.h")) {
-    return "34m[MDBS]";
+  mtx_init(&logger.writer_mutex, mtx_plain);
+}
+
+/**
+ * From now on, LOG() only formats the message into the ring and a background thread writes it out.
+ * Whatever is left is written by exit().
+ */
+int log_start(void) {
+  logger.wakeup = eventfd(0, EFD_CLOEXEC);
+  if (logger.wakeup < 0) {
+    return EXIT_FAILURE;
   }
-  if (!strcmp(filename, "src/prometheus.h")) {
-    return "35m[PRMT]";
+
+  atomic_store_explicit(&logger.running, true, memory_order_release);
+  if (thrd_create(&logger.writer, log_writer, NULL) != thrd_success) {
+    atomic_store_explicit(&logger.running, false, memory_order_release);
+    return EXIT_FAILURE;
   }
 
-  return "31m[????]";
+  return atexit(log_drain) ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
-#define LOG(level, string, ...)                                                                                                            \
-  if (LOG_VERBOSE || level >= LOG_INFO)                                                                                                    \
-  fprintf((level == LOG_ERROR ? stderr : stdout), "\x1b[%s " string "\x1b[0m\n", log_prefix(__FILE__) __VA_OPT__(, ) __VA_ARGS__)
+#define LOG_WRITE(level, tag, ...)                                                                                                         \
+  do {                                                                                                                                     \
+    static LOG_LIMIT log_limit; /* one per call site */                                                                                    \
+    log_write(level, tag, &log_limit, __VA_ARGS__);                                                                                        \
+  } while (0)
+
+#define PERROR_HELPER(fmt, ...) LOG_WRITE(LOG_ERROR, "37;41m", fmt ": %s%s", __VA_ARGS__, strerror(errno)) // NOLINT(concurrency-mt-unsafe)
+#define PERROR(...) PERROR_HELPER(__VA_ARGS__, "")
+
+#define LOG(level, ...)                                                                                                                    \
+  do {                                                                                                                                     \
+    if ((level) >= atomic_load_explicit(&log_level, memory_order_relaxed)) {                                                              \
+      LOG_WRITE(level, LOG_TAG, __VA_ARGS__);                                                                                              \
+    }                                                                                                                                      \
+  } while (0)
 
 #endif /* GROWATT_LOG_H */
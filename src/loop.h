@@ -0,0 +1,428 @@
+#ifndef GROWATT_LOOP_H
+#define GROWATT_LOOP_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h> // close()
+
+#include "influx.h"
+#include "log.h"
+#include "modbus.h"
+#include "mqtt.h"
+#include "prometheus.h"
+#include "reload.h"
+#include "shm.h"
+#include "sink.h"
+
+#undef LOG_TAG
+#define LOG_TAG "36m[LOOP] "
+
+enum {
+  LOOP_MAX_EVENTS = 16,
+};
+
+/**
+ * File descriptors multiplexed by the event loop, -1 when unused
+ */
+typedef struct {
+  int epoll;
+  int signal;
+  int poll_timer;
+  int publish_timer;
+  int modbus;
+  int mqtt;
+  uint32_t mqtt_events;
+  /** Configurations of the cycles run by loop_poll() */
+  const modbus_config *modbus_settings;
+  const mqtt_config *mqtt_settings;
+  const influx_config *influx_settings;
+  /** Code of the cycle which failed, which ends the loop */
+  int code;
+} LOOP;
+
+static int loop_add(const LOOP *loop, const int fd, const uint32_t events) {
+  struct epoll_event event = {.events = events, .data.fd = fd};
+  if (epoll_ctl(loop->epoll, EPOLL_CTL_ADD, fd, &event)) {
+    PERROR("epoll_ctl(%d) failed", fd);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+static int loop_set_timer(const int fd, const time_t period) {
+  // first expiration as soon as possible, then every period
+  const struct itimerspec spec = {.it_interval = {.tv_sec = period}, .it_value = {.tv_nsec = 1}};
+  return timerfd_settime(fd, 0, &spec, NULL);
+}
+
+static int loop_timer(const LOOP *loop, const time_t period) {
+  const int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd < 0) {
+    PERROR("timerfd_create() failed");
+    return -1;
+  }
+
+  if (loop_set_timer(fd, period) || loop_add(loop, fd, EPOLLIN)) {
+    PERROR("timerfd_settime() failed");
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static void loop_drain(const int fd) {
+  uint64_t expirations = 0;
+  if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+    PERROR("read(%d) failed", fd);
+  }
+}
+
+/**
+ * Register the MQTT socket, asking for writability only while mosquitto has pending output
+ */
+static void loop_watch_mqtt(LOOP *loop) {
+  const int fd = mosquitto_socket(client);
+  const uint32_t events = EPOLLIN | (mosquitto_want_write(client) ? EPOLLOUT : 0);
+
+  if (fd != loop->mqtt) {
+    if (loop->mqtt >= 0) {
+      epoll_ctl(loop->epoll, EPOLL_CTL_DEL, loop->mqtt, NULL);
+    }
+    loop->mqtt = fd;
+    loop->mqtt_events = events;
+    if (fd >= 0) {
+      loop_add(loop, fd, events);
+    }
+  } else if (fd >= 0 && events != loop->mqtt_events) {
+    struct epoll_event event = {.events = events, .data.fd = fd};
+    epoll_ctl(loop->epoll, EPOLL_CTL_MOD, fd, &event);
+    loop->mqtt_events = events;
+  }
+}
+
+static void loop_mqtt_failed(LOOP *loop, const int code) {
+  LOG(LOG_ERROR, "MQTT connection lost: %s (%d), reconnecting...", mosquitto_strerror(code), code);
+  loop->mqtt = -1; // closed when reconnecting, the new socket may reuse the same number
+  if (mosquitto_reconnect(client) != MOSQ_ERR_SUCCESS) {
+    LOG(LOG_ERROR, "MQTT reconnection failed, will retry on next publish");
+  }
+  loop_watch_mqtt(loop);
+}
+
+/**
+ * Watch the Modbus socket for late answers and for the device closing the connection, reconnecting first if needed
+ */
+static void loop_watch_modbus(LOOP *loop) {
+  if (loop->modbus >= 0 || ctx == NULL) {
+    return;
+  }
+  if (modbus_get_socket(ctx) < 0 && modbus_connect(ctx)) {
+    PERROR("Modbus reconnection failed, will retry on next poll");
+    return;
+  }
+
+  loop->modbus = modbus_get_socket(ctx);
+  if (loop->modbus >= 0 && loop_add(loop, loop->modbus, EPOLLIN | EPOLLRDHUP)) {
+    loop->modbus = -1;
+  }
+}
+
+/**
+ * The device (e.g. a Modbus TCP gateway) hung up: its socket would stay readable at EOF and spin the loop
+ */
+static void loop_modbus_closed(LOOP *loop) {
+  LOG(LOG_ERROR, "Modbus connection closed by the device, reconnecting...");
+  modbus_close(ctx); // which removes the socket from the epoll set
+  loop->modbus = -1;
+  loop_watch_modbus(loop);
+}
+
+static void loop_accept(LOOP *loop) {
+  const int client_fd = accept(server_socket, NULL, NULL); // NOLINT(android-cloexec-accept)
+  if (client_fd < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      PERROR("HTTP server could not accept request");
+    }
+    return;
+  }
+
+  // the request is read once the client socket is readable so a slow client never blocks the loop in recv()
+  loop_add(loop, client_fd, EPOLLIN | EPOLLRDHUP);
+}
+
+/**
+ * Apply configuration sections offered by the reload callback, re-registering whatever file descriptor changed
+ */
+static int loop_reload(LOOP *loop, modbus_config *modbus, prometheus_config *prometheus, mqtt_config *mqtt, influx_config *influxdb) {
+  modbus_config modbus_next;
+  prometheus_config prometheus_next;
+  mqtt_config mqtt_next;
+
+  if (reload_take(&influx_reload, influxdb)) {
+    sink_configure(&influx_sink, influxdb->queue_policy, influxdb->queue_depth);
+    LOG(LOG_INFO, "InfluxDB configuration reloaded");
+  }
+
+  if (reload_take(&modbus_reload, &modbus_next)) {
+    const int refresh_period = modbus->refresh_period;
+    const modbus_t *previous = ctx;
+    if (apply_modbus_config(modbus, &modbus_next)) {
+      return EXIT_FAILURE;
+    }
+
+    // the previous socket was closed, which removed it from the epoll set already
+    if (ctx != previous) {
+      loop->modbus = -1;
+      loop_watch_modbus(loop);
+    }
+
+    if (refresh_period != modbus->refresh_period && loop_set_timer(loop->poll_timer, modbus->refresh_period)) {
+      PERROR("timerfd_settime() failed");
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (reload_take(&prometheus_reload, &prometheus_next)) {
+    const int previous_socket = server_socket;
+    if (!apply_prometheus_config(prometheus, &prometheus_next) && server_socket != previous_socket &&
+        (fcntl(server_socket, F_SETFL, O_NONBLOCK) || loop_add(loop, server_socket, EPOLLIN))) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (reload_take(&mqtt_reload, &mqtt_next)) {
+    const struct mosquitto *previous = client;
+    if (apply_mqtt_config(mqtt, &mqtt_next)) {
+      return EXIT_FAILURE;
+    }
+    if (client != previous) {
+      loop->mqtt = -1; // closed when disconnecting, the new socket may reuse the same number
+    }
+    loop_watch_mqtt(loop);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+static void loop_close(LOOP *loop) {
+  const int fds[] = {loop->signal, loop->poll_timer, loop->publish_timer, loop->epoll};
+  for (size_t i = 0; i < COUNT(fds); i++) {
+    if (fds[i] >= 0) {
+      close(fds[i]);
+    }
+  }
+
+  if (server_socket >= 0) {
+    close(server_socket);
+  }
+  if (client) {
+    stop_mqtt_thread();
+  }
+  if (ctx) {
+    stop_modbus_thread();
+  }
+}
+
+/**
+ * Run one cycle and hand its values over to the sinks fed as soon as values are read, ends the loop if it failed.
+ * Called on each tick of the poll timer, and by request_fresh_metrics() when a consumer needs fresher values.
+ */
+static int loop_poll(void *loop_ptr) {
+  LOOP *loop = loop_ptr;
+  loop_watch_modbus(loop); // after the device hung up
+  const int code = poll_modbus(loop->modbus_settings);
+  if (code != EXIT_SUCCESS) {
+    loop->code = code;
+    keep_running = 0;
+    return code;
+  }
+
+  if (loop->influx_settings->port) {
+    influx_collect(loop->influx_settings);
+  }
+  if (loop->mqtt_settings->port) {
+    mqtt_collect(loop->mqtt_settings); // streams the values just read
+  }
+  if (shm_segment) {
+    shm_collect();
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Single-threaded alternative to the Modbus, Prometheus, MQTT and InfluxDB threads: one epoll instance waits on the HTTP
+ * listener and clients, the MQTT socket, the Modbus socket, two timers (polling and publishing) and a signalfd, and
+ * sleeps otherwise. Modbus transactions and InfluxDB writes (which follow the cycles) stay synchronous since libmodbus
+ * has no asynchronous API.
+ * SIGHUP calls reload() which is expected to offer new configuration sections to the subsystems.
+ */
+int run_event_loop(const modbus_config *modbus_initial, const prometheus_config *prometheus_initial, const mqtt_config *mqtt_initial,
+                   const influx_config *influx_initial, reload_callback reload, void *reload_context) {
+  span_thread("LOOP");
+
+  modbus_config modbus = *modbus_initial;
+  prometheus_config prometheus = *prometheus_initial;
+  mqtt_config mqtt = *mqtt_initial;
+  influx_config influxdb = *influx_initial;
+
+  LOOP loop = {.epoll = -1, .signal = -1, .poll_timer = -1, .publish_timer = -1, .modbus = -1, .mqtt = -1};
+  loop.modbus_settings = &modbus;
+  loop.mqtt_settings = &mqtt;
+  loop.influx_settings = &influxdb;
+  server_socket = -1;
+  mqtt_threaded = false;
+  refresh.inline_poll = loop_poll;
+  refresh.inline_context = &loop;
+  sink_set_inline(true);
+  int code = EXIT_FAILURE;
+
+  sigset_t signals; // blocked by main() already, before any thread started
+  if (block_signals(&signals)) {
+    PERROR("pthread_sigmask() failed");
+    return EXIT_FAILURE;
+  }
+
+  loop.epoll = epoll_create1(EPOLL_CLOEXEC);
+  loop.signal = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (loop.epoll < 0 || loop.signal < 0 || loop_add(&loop, loop.signal, EPOLLIN)) {
+    PERROR("Could not create event loop");
+    loop_close(&loop);
+    return EXIT_FAILURE;
+  }
+
+  if ((code = connect_modbus(&modbus)) != EXIT_SUCCESS) {
+    loop_close(&loop);
+    return code;
+  }
+  code = EXIT_FAILURE;
+
+  // a response arriving outside of a transaction is a late answer to a request which timed out: flush it so it does
+  // not get mistaken for the answer to the next request
+  loop_watch_modbus(&loop);
+
+  if (prometheus.port) {
+    if (listen_prometheus(&prometheus) || fcntl(server_socket, F_SETFL, O_NONBLOCK) || loop_add(&loop, server_socket, EPOLLIN)) {
+      loop_close(&loop);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (mqtt.port) {
+    if (connect_mqtt(&mqtt)) {
+      loop_close(&loop);
+      return EXIT_FAILURE;
+    }
+    loop_watch_mqtt(&loop);
+
+    if ((loop.publish_timer = loop_timer(&loop, PUBLISH_PERIOD)) < 0) {
+      loop_close(&loop);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if ((loop.poll_timer = loop_timer(&loop, modbus.refresh_period)) < 0) {
+    loop_close(&loop);
+    return EXIT_FAILURE;
+  }
+
+  LOG(LOG_INFO, "Event loop running...");
+
+  code = EXIT_SUCCESS;
+  struct epoll_event events[LOOP_MAX_EVENTS];
+
+  while (keep_running) {
+    const int count = epoll_wait(loop.epoll, events, LOOP_MAX_EVENTS, -1);
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      PERROR("epoll_wait() failed");
+      code = EXIT_FAILURE;
+      break;
+    }
+
+    for (int i = 0; i < count && keep_running; i++) {
+      const int fd = events[i].data.fd;
+
+      if (fd == loop.signal) {
+        struct signalfd_siginfo info;
+        if (read(loop.signal, &info, sizeof(info)) != sizeof(info)) {
+          continue;
+        }
+        LOG(LOG_INFO, "Got signal %" PRIu32, info.ssi_signo);
+        if (info.ssi_signo == SIGUSR1) {
+          LOG(LOG_INFO, "Log level is now %s", log_level_name(log_cycle_level()));
+        } else if (info.ssi_signo == SIGUSR2) {
+          span_dump_file();
+        } else if (info.ssi_signo != SIGHUP) {
+          keep_running = 0;
+        } else if (!reload(reload_context) && loop_reload(&loop, &modbus, &prometheus, &mqtt, &influxdb)) {
+          code = EXIT_FAILURE;
+          keep_running = 0;
+        }
+      } else if (fd == loop.poll_timer) {
+        loop_drain(fd);
+        loop_poll(&loop);
+      } else if (fd == loop.publish_timer) {
+        loop_drain(fd);
+        const int mqtt_code = mosquitto_loop_misc(client); // keepalive pings
+        if (mqtt_code != MOSQ_ERR_SUCCESS) {
+          loop_mqtt_failed(&loop, mqtt_code);
+        } else {
+          publish_state(&mqtt);
+        }
+      } else if (fd == loop.modbus && events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        loop_modbus_closed(&loop);
+      } else if (fd == loop.modbus) {
+        LOG(LOG_DEBUG, "Flushing unexpected Modbus data");
+        modbus_flush(ctx);
+      } else if (fd == loop.mqtt) {
+        int mqtt_code = MOSQ_ERR_SUCCESS;
+        if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+          mqtt_code = mosquitto_loop_read(client, 1);
+        }
+        if (mqtt_code == MOSQ_ERR_SUCCESS && events[i].events & EPOLLOUT) {
+          mqtt_code = mosquitto_loop_write(client, 1);
+        }
+        if (mqtt_code != MOSQ_ERR_SUCCESS) {
+          loop_mqtt_failed(&loop, mqtt_code);
+        }
+      } else if (fd == server_socket) {
+        loop_accept(&loop);
+      } else {
+        handle_client(fd, &prometheus); // also closes fd, which removes it from the epoll set
+      }
+    }
+
+    if (client) {
+      loop_watch_mqtt(&loop);
+    }
+  }
+
+  LOG(LOG_INFO, "Event loop stopped");
+  refresh.inline_poll = NULL; // loop is going away
+  if (poll_stopped) {
+    poll_stopped(&modbus); // the device polled last, rather than the one a rejected reload asked for
+  }
+  if (loop.code != EXIT_SUCCESS) {
+    code = loop.code;
+  }
+  if (influxdb.port) {
+    influx.retry_at = 0;
+    influx_flush(&influxdb); // last chance for what is left
+  }
+  loop_close(&loop);
+
+  return code;
+}
+
+#endif /* GROWATT_LOOP_H */
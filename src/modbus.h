@@ -2,23 +2,34 @@
 #define GROWATT_MODBUS_H
 
 #include <assert.h>
-#include <bsd/string.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <limits.h> // INT_MAX
 #include <math.h>
 #include <modbus.h>
+#include <stdatomic.h>
+#include <stdint.h> // SIZE_MAX
 #include <stdio.h>
 #include <stdlib.h>
 #include <threads.h>
 #include <time.h>
 #include <unistd.h> // sleep()
 
+#include "capability.h"
+#include "command.h"
 #include "growatt.h"
+#include "latency.h"
 #include "log.h"
+#include "reload.h"
+#include "span.h"
+#include "trace.h"
+
+#undef LOG_TAG
+#define LOG_TAG "34m[MDBS] "
 
 enum {
-  REFRESH_PERIOD = 10, // seconds
+  REFRESH_PERIOD = 10,    // seconds
+  METRIC_TTL_PERIODS = 3, // default lifetime of metrics, in refresh periods
   HOUR = 3600,
   DAY = 24 * HOUR,
 };
@@ -28,34 +39,111 @@ enum {
 #define DEBUG FALSE
 
 #define METRIC_BUFFER_SIZE 256U
-#define RESPONSE_BUFFER_SIZE 8192U
+#define RESPONSE_BUFFER_SIZE (8192U * MODBUS_MAX_SLAVES)
 
 enum {
   MODBUS_BAUD = 9600,
   MODBUS_PARITY = 'N',
   MODBUS_DATA_BIT = 8,
   MODBUS_STOP_BIT = 1,
-  MODBUS_RESPONSE_TIMEOUT = 500000U, // in us
+  MODBUS_RESPONSE_TIMEOUT = 500000U, // in us, until enough latency samples are collected
+  MODBUS_RESPONSE_TIMEOUT_MIN = 100,  // ms
+  MODBUS_RESPONSE_TIMEOUT_MAX = 2000, // ms
+  LATENCY_MIN_SAMPLES = 8U,           // before tuning timeouts
+  REFRESH_DEADLINE = 10,              // seconds a consumer waits for fresh metrics in on-demand mode
+  MODBUS_MAX_SLAVES = 8U,             // units sharing one bus
+  MODBUS_MAX_SLAVE_ID = 247,
+  SLAVE_DEAD_AFTER = 3U,              // consecutive timeouts after which a unit is skipped for the rest of the cycle
+  SLAVE_MAX_BACKOFF = 5U,             // a failing unit is polled at least every 2^SLAVE_MAX_BACKOFF cycles
+  SLAVE_SKIPPED = -1,                 // returned for a unit left out of the round, neither a success nor a failure
 };
 
+typedef struct {
+  char device_or_uri[CONFIG_STRING_SIZE];
+  /** Lower bound of the adaptive response timeout in ms */
+  int response_timeout_min;
+  /** Upper bound of the adaptive response timeout in ms */
+  int response_timeout_max;
+  /** Seconds between two query cycles */
+  int refresh_period;
+  /** On-demand mode when > 0: consumers trigger a query cycle when metrics are older than this (in seconds) */
+  int max_age;
+  /** Units polled in turn over the same bus, slave 1 (or the TCP default) when slave_count is 0 */
+  int slave_ids[MODBUS_MAX_SLAVES];
+  int slave_count;
+  /** File written by --scan, telling which registers are not worth reading (optional) */
+  char capability_cache[CONFIG_STRING_SIZE];
+  /** Seconds after which a metric not read again is dropped, 0 to keep it until replaced */
+  int metric_ttl;
+} modbus_config;
+
 enum {
   REGISTER_SIZE = 16U,
   HEX_SIZE = 8U, // bytes for hex representation
 };
 
-typedef struct __attribute__((aligned(METRIC_BUFFER_SIZE / 2))) {
-  char name[METRIC_BUFFER_SIZE];
+enum {
+  RETRY_BUDGET = 2000U, // ms spent re-reading failed registers within the same cycle
+  RETRY_ROUNDS = 2U,
+  RETRY_MAX_GAP = 4U,  // unused registers read in between two failed ones to coalesce them into one request
+  REANCHOR_AFTER = 3U, // consecutive rejected cycles after which relative checks are skipped
+};
+
+typedef enum { REGISTER_HOLDING, REGISTER_INPUT } REGISTER_TYPE;
+
+/**
+ * Consecutive registers of a table read with a single request
+ */
+typedef struct {
+  int start;
+  int length;
+  /** Indexes of the first and last registers of the table in the block */
+  size_t first;
+  size_t last;
+} BLOCK;
+
+/**
+ * Requests reading a whole register table, built from what is known about the unit
+ */
+typedef struct {
+  BLOCK blocks[COUNT(input_registers) > COUNT(holding_registers) ? COUNT(input_registers) : COUNT(holding_registers)];
+  size_t size;
+} PLAN;
+
+/**
+ * Last accepted value of a register, used by relative sanity checks
+ */
+typedef struct {
+  double value;
+  time_t at;
+  /** Number of consecutive cycles the register was rejected as implausible */
+  unsigned rejected;
+} REGISTER_STATE;
+
+typedef struct {
+  char name[MAX_METRIC_LENGTH];
   double value;
+  /** Time the value was read, in ms since the epoch */
+  int64_t at;
+  /** Time after which the value is too old to be served, in ms since the epoch */
+  int64_t expires_at;
 } METRIC;
 
 /**
- * Use (blocking) mutex to access struct
+ * Metrics store of one unit on the bus.
+ * Use (blocking) mutex to access metrics and size, everything else belongs to the Modbus thread
  */
-typedef struct __attribute__((aligned(METRIC_BUFFER_SIZE / 2))) {
+typedef struct {
   mtx_t mutex;
+  /** Latest sample of each metric, updated as soon as each block of registers is read */
   METRIC *metrics;
   /** Number of metrics stored in array (for internal use) */
   size_t size;
+  /** Metrics of the cycle in progress, merged into metrics block by block */
+  METRIC *cycle_metrics;
+  size_t cycle_size;
+  /** Number of cycle_metrics merged already */
+  size_t cycle_published;
   /** Number of metrics successfully read */
   size_t read_metric_succeeded_total;
   /** Number of metrics failed to read */
@@ -64,38 +152,369 @@ typedef struct __attribute__((aligned(METRIC_BUFFER_SIZE / 2))) {
   time_t last_time_synced_at;
   /** Timestamp of last time settings were queried */
   time_t last_time_read_settings_at;
+  /** Number of registers which needed to be read again */
+  size_t read_metric_retried_total;
+  REGISTER_STATE holding_states[COUNT(holding_registers)];
+  REGISTER_STATE input_states[COUNT(input_registers)];
+  CAPABILITY capability;
+  PLAN holding_plan;
+  PLAN input_plan;
+  int slave_id;
+  /** Consecutive timeouts in the current cycle, the unit is skipped once it reaches SLAVE_DEAD_AFTER */
+  unsigned timeouts;
+  /** Consecutive cycles without metrics, the unit is then polled every 2^failures cycles only */
+  unsigned failures;
+  /** Round (see BUS) before which the unit is not polled */
+  unsigned long skip_until;
 } METRICS;
 
-// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
-METRICS device_metrics;
+/**
+ * State shared by all units on the line, belongs to the Modbus thread
+ */
+typedef struct {
+  /** Latency of successful read transactions */
+  LATENCY latency;
+  /** Response timeout currently applied in ms */
+  double response_timeout;
+  /** Time spent in transactions since busy_since, in ms */
+  double busy;
+  double busy_since;
+  /** Share of time the line was busy during the last round */
+  double utilization;
+  /** Number of rounds polling each unit in turn */
+  unsigned long rounds;
+  /** Talk to the unit with modbus_set_slave(), not needed with a single TCP unit */
+  bool select_slave;
+  /** Lifetime of the metrics read, in seconds (see modbus_config) */
+  int metric_ttl;
+} BUS;
+
+/**
+ * Register waiting to be read again within the current cycle
+ */
+typedef struct {
+  REGISTER_TYPE type;
+  const REGISTER *reg;
+  REGISTER_STATE *state;
+  /** Last attempt was read fine but failed sanity checks */
+  bool implausible;
+} RETRY;
+
+typedef struct {
+  RETRY entries[COUNT(holding_registers) + COUNT(input_registers)];
+  size_t size;
+} RETRY_QUEUE;
+
+/**
+ * Request/notify channel between consumers wanting fresh metrics and the Modbus thread (on-demand mode)
+ */
+typedef struct {
+  mtx_t mutex;
+  /** Signalled when a consumer asks for a cycle */
+  cnd_t requested;
+  /** Broadcast when a cycle completes */
+  cnd_t completed;
+  bool pending;
+  bool in_flight;
+  /** Number of completed cycles */
+  unsigned long cycles;
+  /** Time the last cycle completed */
+  time_t polled_at;
+  /** 0 unless on-demand mode is enabled */
+  int max_age;
+  /** Set by the event loop: stale metrics are then refreshed synchronously instead of waiting for the Modbus thread */
+  int (*inline_poll)(void *context);
+  void *inline_context;
+} REFRESH;
+
+// NOLINTBEGIN(cppcoreguidelines-avoid-non-const-global-variables)
+METRICS device_metrics[MODBUS_MAX_SLAVES];
+static atomic_size_t slave_count = 1;
+static METRICS *current_slave = device_metrics; // unit the transactions in progress are addressed to
+static BUS bus;
+// NOLINTEND(cppcoreguidelines-avoid-non-const-global-variables)
 
 // NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
 static modbus_t *ctx = NULL;
 
-void add_metric(char const name[static 1], const double value) {
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static REFRESH refresh;
+
+// NOLINTBEGIN(cppcoreguidelines-avoid-non-const-global-variables)
+static modbus_config modbus_pending;
+static RELOAD modbus_reload;
+// NOLINTEND(cppcoreguidelines-avoid-non-const-global-variables)
+
+/** Called by the Modbus thread after each cycle, e.g. to persist state */
+typedef void (*poll_callback)(const modbus_config *config);
+
+/** Called by the thread which just changed the published metrics of the unit at index slave (the Modbus thread once running) */
+typedef void (*metrics_callback)(size_t slave);
+
+/** Called by the Modbus thread at the end of each query, to add metrics of its own with push_metric() */
+typedef void (*push_callback)(void);
+
+// NOLINTBEGIN(cppcoreguidelines-avoid-non-const-global-variables)
+static poll_callback poll_completed = NULL;
+static poll_callback poll_stopped = NULL; // once the owner of the connection stops polling, with its own configuration
+static metrics_callback metrics_updated = NULL;
+static push_callback metrics_pushing = NULL;
+// NOLINTEND(cppcoreguidelines-avoid-non-const-global-variables)
+
+int64_t realtime_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000; // NOLINT(readability-magic-numbers)
+}
+
+bool metric_expired(const METRIC *metric, const int64_t now) { return now >= metric->expires_at; }
+
+/**
+ * Tell consumers that the published metrics of the unit at index slave changed, once the change is visible
+ */
+void metrics_changed(const size_t slave) {
+  if (metrics_updated) {
+    metrics_updated(slave);
+  }
+}
+
+/**
+ * Append a sample to the cycle in progress, it is served for ttl seconds (forever when 0) unless read again
+ */
+static void push_sample(char const name[static 1], const double value, const int ttl) {
   METRIC metric;
-  strlcpy(metric.name, name, METRIC_BUFFER_SIZE);
+  strlcpy(metric.name, name, sizeof(metric.name));
   metric.value = value;
+  metric.at = realtime_ms();
+  metric.expires_at = ttl > 0 ? metric.at + (int64_t)ttl * 1000 : INT64_MAX; // NOLINT(readability-magic-numbers)
 
-  METRIC *new_metrics = realloc(device_metrics.metrics, (device_metrics.size + 1) * sizeof(metric));
+  METRIC *new_metrics = realloc(current_slave->cycle_metrics, (current_slave->cycle_size + 1) * sizeof(metric));
   if (new_metrics == NULL) {
     PERROR("realloc failed");
     exit(errno);
   }
-  device_metrics.metrics = new_metrics;
-  device_metrics.metrics[device_metrics.size++] = metric;
+  current_slave->cycle_metrics = new_metrics;
+  current_slave->cycle_metrics[current_slave->cycle_size++] = metric;
+}
+
+static void push_metric(char const name[static 1], const double value) { push_sample(name, value, bus.metric_ttl); }
 
-  if (strcmp(name, "read_metric_failed_total") != 0 && strcmp(name, "read_metric_succeeded_total") != 0) {
-    device_metrics.read_metric_succeeded_total++;
+/**
+ * Merge the samples pushed since the last call into the published metrics, so that consumers see each block of
+ * registers as soon as it is read rather than at the end of the cycle.
+ * Must be called with the store locked.
+ */
+static void merge_samples(METRICS *store) {
+  for (size_t index = store->cycle_published; index < store->cycle_size; index++) {
+    const METRIC *sample = &store->cycle_metrics[index];
+    size_t i = 0;
+    while (i < store->size && strcmp(store->metrics[i].name, sample->name) != 0) {
+      i++;
+    }
+
+    if (i == store->size) {
+      METRIC *new_metrics = realloc(store->metrics, (store->size + 1) * sizeof(METRIC));
+      if (new_metrics == NULL) {
+        PERROR("realloc failed");
+        exit(errno);
+      }
+      store->metrics = new_metrics;
+      store->size++;
+    }
+    store->metrics[i] = *sample;
   }
 }
 
+/**
+ * Publish the samples pushed since the last call
+ */
+static void publish_samples(void) {
+  if (current_slave->cycle_published == current_slave->cycle_size) {
+    return;
+  }
+
+  const uint64_t span = span_begin();
+  mtx_lock(&current_slave->mutex);
+  span_end(span, "metrics_lock", NULL, 0); // waiting for readers
+  merge_samples(current_slave);
+  mtx_unlock(&current_slave->mutex);
+
+  current_slave->cycle_published = current_slave->cycle_size;
+  metrics_changed((size_t)(current_slave - device_metrics));
+}
+
+/**
+ * Publish what is left of the cycle which just completed and drop the metrics which expired
+ */
+static void publish_cycle(void) {
+  publish_samples();
+
+  const int64_t now = realtime_ms();
+  mtx_lock(&current_slave->mutex);
+  size_t kept = 0;
+  for (size_t i = 0; i < current_slave->size; i++) {
+    if (!metric_expired(&current_slave->metrics[i], now)) {
+      current_slave->metrics[kept++] = current_slave->metrics[i];
+    }
+  }
+  const bool expired = kept < current_slave->size;
+  current_slave->size = kept;
+  mtx_unlock(&current_slave->mutex);
+  if (expired) {
+    metrics_changed((size_t)(current_slave - device_metrics));
+  }
+
+  free(current_slave->cycle_metrics);
+  current_slave->cycle_metrics = NULL;
+  current_slave->cycle_size = 0;
+  current_slave->cycle_published = 0;
+}
+
+/**
+ * Push the value of a register, which lives ttl seconds longer than metrics computed every cycle
+ */
+void add_metric(char const name[static 1], const double value, const int ttl) {
+  push_sample(name, value, bus.metric_ttl > 0 ? bus.metric_ttl + ttl : 0);
+  current_slave->read_metric_succeeded_total++;
+}
+
 #define modbus_read_holding_registers modbus_read_registers
 #define modbus_write_holding_registers modbus_write_registers
 
+static double monotonic_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec * 1e3 + (double)now.tv_nsec / 1e6; // NOLINT(readability-magic-numbers)
+}
+
+/**
+ * Whether the last request failed because the device answered with an exception (rather than not at all)
+ */
+static bool modbus_exception(const int error) { return error > MODBUS_ENOBASE && error <= EMBXGTAR; }
+
+/**
+ * Record a transaction started at traced_at into the trace when recording, errno is left untouched
+ */
+static void trace_transaction(modbus_t *ctx, const uint8_t function, const int addr, const int size, const uint64_t traced_at,
+                              const int ret, const uint16_t *words) {
+  if (!trace_enabled()) {
+    return;
+  }
+
+  const int error = errno;
+  const int status = -1 != ret ? 0 : (modbus_exception(error) ? error - MODBUS_ENOBASE : TRACE_TIMEOUT);
+  trace_record((uint8_t)modbus_get_slave(ctx), function, addr, size, traced_at, status, words);
+  errno = error;
+}
+
+/**
+ * Read consecutive registers, feeding the latency estimate used to tune timeouts
+ */
+int read_block(modbus_t *ctx, REGISTER_TYPE type, const int addr, const int size, uint16_t *dest) {
+  if (current_slave->timeouts >= SLAVE_DEAD_AFTER) {
+    errno = ETIMEDOUT; // don't let a dead unit hold the line for the rest of the cycle
+    return -1;
+  }
+
+  const uint64_t traced_at = trace_enabled() ? trace_clock() : 0;
+  const uint64_t span = span_begin();
+  const double started_at = monotonic_ms();
+  const int ret = type == REGISTER_HOLDING ? modbus_read_holding_registers(ctx, addr, size, dest)
+                                           : modbus_read_input_registers(ctx, addr, size, dest);
+  const double elapsed = monotonic_ms() - started_at;
+  span_end(span, type == REGISTER_HOLDING ? "read_holding_registers" : "read_input_registers", "address", addr);
+  bus.busy += elapsed;
+  trace_transaction(ctx, type == REGISTER_HOLDING ? MODBUS_FC_READ_HOLDING_REGISTERS : MODBUS_FC_READ_INPUT_REGISTERS, addr, size,
+                    traced_at, ret, dest);
+
+  if (-1 != ret) {
+    latency_record(&bus.latency, elapsed);
+    current_slave->timeouts = 0;
+  } else if (errno == ETIMEDOUT) {
+    current_slave->timeouts++;
+    // the real latency is unknown but at least the current timeout, so this pushes the estimate up,
+    // unless the unit is known to be failing: its timeouts say nothing about the line
+    if (!current_slave->failures) {
+      latency_record(&bus.latency, bus.response_timeout);
+    }
+  }
+
+  return ret;
+}
+
+/**
+ * Write consecutive holding registers, a single one with the dedicated function
+ */
+int write_block(modbus_t *ctx, const int addr, const int size, const uint16_t *words) {
+  const uint64_t traced_at = trace_enabled() ? trace_clock() : 0;
+  const uint64_t span = span_begin();
+  const int ret = size == 1 ? modbus_write_register(ctx, addr, words[0]) : modbus_write_holding_registers(ctx, addr, size, words);
+  span_end(span, "write_registers", "address", addr);
+  trace_transaction(ctx, size == 1 ? MODBUS_FC_WRITE_SINGLE_REGISTER : MODBUS_FC_WRITE_MULTIPLE_REGISTERS, addr, size, traced_at,
+                    ret, words);
+
+  return ret;
+}
+
+/**
+ * Address the following transactions to the unit at index
+ */
+static int select_slave(modbus_t *ctx, const size_t index) {
+  current_slave = &device_metrics[index];
+  return bus.select_slave && modbus_set_slave(ctx, current_slave->slave_id) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+size_t find_slave(const int slave_id) {
+  for (size_t index = 0; index < atomic_load(&slave_count); index++) {
+    if (device_metrics[index].slave_id == slave_id) {
+      return index;
+    }
+  }
+
+  return SIZE_MAX;
+}
+
+int set_timeouts(modbus_t *ctx, const double timeout) {
+  const uint32_t response_us = (uint32_t)(timeout * 1e3); // NOLINT(readability-magic-numbers)
+  const uint32_t byte_us = response_us / 2;                // a stalled frame gives up within half the response time
+
+  // NOLINTBEGIN(readability-magic-numbers)
+  if (modbus_set_response_timeout(ctx, response_us / 1000000U, response_us % 1000000U) ||
+      modbus_set_byte_timeout(ctx, byte_us / 1000000U, byte_us % 1000000U)) {
+    return EXIT_FAILURE;
+  }
+  // NOLINTEND(readability-magic-numbers)
+
+  bus.response_timeout = timeout;
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Adjust response and byte timeouts to the observed latency, within configured bounds
+ */
+void tune_timeouts(modbus_t *ctx, const modbus_config *config) {
+  if (bus.latency.count < LATENCY_MIN_SAMPLES) {
+    return;
+  }
+
+  const double timeout = latency_timeout(&bus.latency, config->response_timeout_min, config->response_timeout_max);
+  if (fabs(timeout - bus.response_timeout) < 1) {
+    return;
+  }
+
+  if (set_timeouts(ctx, timeout)) {
+    PERROR("Set timeouts failed");
+    return;
+  }
+
+  LOG(LOG_DEBUG, "Response timeout set to %.0lfms (mean = %.1lfms, p99 = %.1lfms)", timeout, bus.latency.mean,
+      latency_percentile(&bus.latency, LATENCY_PERCENTILE));
+}
+
 ssize_t read_holding_register_scaled_by(modbus_t *ctx, const int addr, double *value, double scale) {
   uint16_t buffer[1] = {0};
-  ssize_t ret = modbus_read_holding_registers(ctx, addr, 1, buffer);
+  ssize_t ret = read_block(ctx, REGISTER_HOLDING, addr, 1, buffer);
   *value = (double)buffer[0] * scale;
 
   return ret;
@@ -103,7 +522,7 @@ ssize_t read_holding_register_scaled_by(modbus_t *ctx, const int addr, double *v
 
 ssize_t read_holding_register_double_scaled_by(modbus_t *ctx, const int addr, double *value, double scale) {
   uint16_t buffer[2] = {0};
-  ssize_t ret = modbus_read_holding_registers(ctx, addr, 2, buffer);
+  ssize_t ret = read_block(ctx, REGISTER_HOLDING, addr, 2, buffer);
   // NOLINTNEXTLINE(hicpp-signed-bitwise)
   *value = ((double)(buffer[0] << REGISTER_SIZE) + (double)(buffer[1])) * scale;
 
@@ -112,7 +531,7 @@ ssize_t read_holding_register_double_scaled_by(modbus_t *ctx, const int addr, do
 
 ssize_t read_input_register_scaled_by(modbus_t *ctx, const int addr, double *value, double scale) {
   uint16_t buffer[1] = {0};
-  ssize_t ret = modbus_read_input_registers(ctx, addr, 1, buffer);
+  ssize_t ret = read_block(ctx, REGISTER_INPUT, addr, 1, buffer);
   *value = (double)buffer[0] * scale;
 
   return ret;
@@ -120,7 +539,7 @@ ssize_t read_input_register_scaled_by(modbus_t *ctx, const int addr, double *val
 
 ssize_t read_input_register_double_scaled_by(modbus_t *ctx, const int addr, double *value, double scale) {
   uint16_t buffer[2] = {0};
-  ssize_t ret = modbus_read_input_registers(ctx, addr, 2, buffer);
+  ssize_t ret = read_block(ctx, REGISTER_INPUT, addr, 2, buffer);
   // NOLINTNEXTLINE(hicpp-signed-bitwise)
   *value = ((double)(buffer[0] << REGISTER_SIZE) + (double)(buffer[1])) * scale;
 
@@ -151,7 +570,7 @@ void clock_write(modbus_t *ctx) {
   print_register(hex, clock, REGISTER_CLOCK_SIZE);
   LOG(LOG_DEBUG, "About to write %s into clock register", hex);
 
-  if (REGISTER_CLOCK_SIZE != modbus_write_holding_registers(ctx, REGISTER_CLOCK_ADDRESS, REGISTER_CLOCK_SIZE, clock)) {
+  if (REGISTER_CLOCK_SIZE != write_block(ctx, REGISTER_CLOCK_ADDRESS, REGISTER_CLOCK_SIZE, clock)) {
     PERROR("Writing clock failed");
   } else {
     LOG(LOG_INFO, "Writing clock succeeded");
@@ -160,7 +579,7 @@ void clock_write(modbus_t *ctx) {
 
 int clock_sync(modbus_t *ctx) {
   uint16_t clock[REGISTER_CLOCK_SIZE] = {0};
-  if (-1 == modbus_read_holding_registers(ctx, REGISTER_CLOCK_ADDRESS, REGISTER_CLOCK_SIZE, clock)) {
+  if (-1 == read_block(ctx, REGISTER_HOLDING, REGISTER_CLOCK_ADDRESS, REGISTER_CLOCK_SIZE, clock)) {
     PERROR("Reading clock failed");
     return INT_MAX;
   }
@@ -203,6 +622,71 @@ int clock_sync(modbus_t *ctx) {
   return EXIT_SUCCESS;
 }
 
+static int register_length(const REGISTER *reg) { return reg->register_size == REGISTER_DOUBLE ? 2 : 1; }
+
+static double decode_register(const REGISTER *reg, const uint16_t *buffer) {
+  if (reg->register_size == REGISTER_DOUBLE) {
+    // NOLINTNEXTLINE(hicpp-signed-bitwise)
+    return ((double)(buffer[0] << REGISTER_SIZE) + (double)(buffer[1])) * reg->scale;
+  }
+
+  return (double)buffer[0] * reg->scale;
+}
+
+/**
+ * Write one queued setting and read it back to verify the device accepted it
+ */
+static bool execute_command(modbus_t *ctx, const COMMAND *command) {
+  const REGISTER *reg = command->reg;
+  const int length = register_length(reg);
+  const uint32_t raw = (uint32_t)lround(command->value / reg->scale);
+  const uint16_t words[2] = {length == 2 ? (uint16_t)(raw >> REGISTER_SIZE) : (uint16_t)raw, (uint16_t)raw};
+
+  if (-1 == write_block(ctx, reg->address, length, words)) {
+    PERROR("Writing register %" PRIu8 " (%s) failed", reg->address, reg->human_name);
+    return false;
+  }
+
+  uint16_t check[2] = {0};
+  if (-1 == read_block(ctx, REGISTER_HOLDING, reg->address, length, check)) {
+    PERROR("Reading back register %" PRIu8 " (%s) failed", reg->address, reg->human_name);
+    return false;
+  }
+
+  if (memcmp(check, words, length * sizeof(uint16_t)) != 0) {
+    LOG(LOG_ERROR, "Register %" PRIu8 " (%s) reads %lf after writing %lf", reg->address, reg->human_name,
+        decode_register(reg, check), command->value);
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Drain the command queue, called by the Modbus thread in between two transactions
+ */
+void execute_commands(modbus_t *ctx) {
+  const size_t polled = (size_t)(current_slave - device_metrics);
+  COMMAND command;
+
+  while (ctx && next_command(&command)) {
+    const bool succeeded =
+        command.slave < atomic_load(&slave_count) && !select_slave(ctx, command.slave) && execute_command(ctx, &command);
+    const double latency = monotonic_ms() - command.queued_at;
+    command_completed(succeeded, latency);
+
+    if (succeeded) {
+      LOG(LOG_INFO, "Set %s of slave %d to %lf in %.0lfms", command.reg->metric_name, current_slave->slave_id, command.value,
+          latency);
+      current_slave->last_time_read_settings_at = 0; // publish the new settings with the next cycle
+    }
+  }
+
+  if (current_slave != &device_metrics[polled] && select_slave(ctx, polled)) {
+    PERROR("Set slave failed");
+  }
+}
+
 int query_device_failed(modbus_t *ctx, char const message[static 1]) {
   if (errno) {
     PERROR("%s: %s (%d)", message, modbus_strerror(errno), errno);
@@ -216,7 +700,7 @@ int query_device_failed(modbus_t *ctx, char const message[static 1]) {
 }
 
 void read_register_failed(const REGISTER *reg) {
-  device_metrics.read_metric_failed_total++;
+  current_slave->read_metric_failed_total++;
 
   LOG(LOG_ERROR, "Reading register %" PRIu8 " (%s) failed", reg->address, reg->human_name);
 
@@ -225,110 +709,355 @@ void read_register_failed(const REGISTER *reg) {
   }
 }
 
-int query_modbus(modbus_t *ctx) {
-  if (device_metrics.metrics) {
-    free(device_metrics.metrics);
+/**
+ * Check a freshly read value against the register's sanity checks.
+ * Returns NULL when the value is plausible, a short reason otherwise.
+ */
+const char *check_register(const REGISTER *reg, const REGISTER_STATE *state, const double value, const time_t now) {
+  const CHECK *check = &reg->check;
+
+  if (check->max > check->min && (value < check->min || value > check->max)) {
+    return "out of range";
+  }
+
+  // relative checks need a previous value and are skipped once it looks stale rather than the new one bogus
+  if (!state->at || state->rejected >= REANCHOR_AFTER) {
+    return NULL;
+  }
+
+  if (check->monotonic && value < state->value) {
+    return "decreasing counter";
   }
 
-  device_metrics.metrics = malloc(sizeof(METRIC));
-  device_metrics.size = 0;
-  device_metrics.read_metric_failed_total = 0;
-  device_metrics.read_metric_succeeded_total = 0;
+  const double elapsed = difftime(now, state->at) > 1 ? difftime(now, state->at) : 1;
+  if (check->max_rate > 0 && fabs(value - state->value) / elapsed > check->max_rate) {
+    return "changing too fast";
+  }
+
+  return NULL;
+}
+
+static void retry_register(RETRY_QUEUE *queue, REGISTER_TYPE type, const REGISTER *reg, REGISTER_STATE *state, bool implausible) {
+  assert(queue->size < COUNT(queue->entries));
+  queue->entries[queue->size++] = (RETRY){type, reg, state, implausible};
+}
 
+static void store_register(RETRY_QUEUE *queue, REGISTER_TYPE type, const REGISTER *reg, REGISTER_STATE *state, const double value) {
   const time_t now = time(NULL);
+  const char *reason = check_register(reg, state, value, now);
 
-  LOG(LOG_TRACE, "now - last_time_synced_at = %.0lfs", difftime(now, device_metrics.last_time_synced_at));
-  if (difftime(now, device_metrics.last_time_synced_at) > 1 * DAY) {
-    if (clock_sync(ctx)) {
-      LOG(LOG_INFO, "Synced time");
+  if (reason) {
+    LOG(LOG_ERROR, "Discarding register %" PRIu8 " (%s) = %lf: %s", reg->address, reg->human_name, value, reason);
+    retry_register(queue, type, reg, state, true);
+    return;
+  }
+
+  state->value = value;
+  state->at = now;
+  state->rejected = 0;
+  add_metric(reg->metric_name, value, type == REGISTER_HOLDING ? HOUR : 0); // settings are read every hour only
+}
+
+/**
+ * Group the registers of a table into as few requests as possible. Registers the unit does not support are left out.
+ * Addresses in between two registers are read along only when known to be supported, so without a capability cache
+ * only adjacent registers share a request.
+ */
+void plan_registers(PLAN *plan, const REGISTER *registers, const size_t count, const CAPABILITY_MAP *map, const bool known) {
+  plan->size = 0;
+
+  for (size_t index = 0; index < count; index++) {
+    const REGISTER *reg = &registers[index];
+    const int length = register_length(reg);
+
+    if (known && !capability_supported(map, reg->address, length)) {
+      LOG(LOG_DEBUG, "Register %" PRIu8 " (%s) is not supported, skipping it", reg->address, reg->human_name);
+      continue;
     }
 
-    device_metrics.last_time_synced_at = now;
+    BLOCK *block = plan->size ? &plan->blocks[plan->size - 1] : NULL;
+    const int end = block ? block->start + block->length : 0;
+    const int gap = reg->address - end;
+
+    if (block && gap >= 0 && reg->address + length - block->start <= MODBUS_MAX_READ_REGISTERS &&
+        (gap == 0 || (known && gap <= (int)RETRY_MAX_GAP && capability_supported(map, end, gap)))) {
+      block->length = reg->address + length - block->start;
+      block->last = index;
+    } else {
+      plan->blocks[plan->size++] = (BLOCK){reg->address, length, index, index};
+    }
   }
+}
 
-  LOG(LOG_TRACE, "now - last_time_read_settings_at = %.0lfs", difftime(now, device_metrics.last_time_read_settings_at));
-  if (difftime(now, device_metrics.last_time_read_settings_at) > 1 * HOUR) {
-    for (size_t index = 0; index < COUNT(holding_registers); index++) {
-      const REGISTER reg = holding_registers[index];
-      ssize_t ret = -1;
-      double result[2] = {0};
+static void plan_slave(METRICS *metrics) {
+  const CAPABILITY *capability = &metrics->capability;
+  plan_registers(&metrics->holding_plan, holding_registers, COUNT(holding_registers), &capability->holding, capability->known);
+  plan_registers(&metrics->input_plan, input_registers, COUNT(input_registers), &capability->input, capability->known);
 
-      switch (reg.register_size) {
-      case REGISTER_SINGLE:
-        ret = read_holding_register_scaled_by(ctx, reg.address, result, reg.scale);
-        break;
+  LOG(LOG_DEBUG, "Slave %d: reading %zu holding and %zu input registers in %zu and %zu requests", metrics->slave_id,
+      COUNT(holding_registers), COUNT(input_registers), metrics->holding_plan.size, metrics->input_plan.size);
+}
 
-      case REGISTER_DOUBLE:
-        ret = read_holding_register_double_scaled_by(ctx, reg.address, result, reg.scale);
+/**
+ * Read a register table following plan, registers which cannot be read are queued for retry
+ */
+int read_registers(modbus_t *ctx, RETRY_QUEUE *queue, REGISTER_TYPE type, const PLAN *plan, const REGISTER *registers,
+                   REGISTER_STATE *states) {
+  for (size_t index = 0; index < plan->size; index++) {
+    execute_commands(ctx);
+
+    const BLOCK *block = &plan->blocks[index];
+    uint16_t buffer[MODBUS_MAX_READ_REGISTERS] = {0};
+    const int ret = read_block(ctx, type, block->start, block->length, buffer);
+    const bool exception = -1 == ret && modbus_exception(errno);
+
+    for (size_t i = block->first; i <= block->last; i++) {
+      const REGISTER *reg = &registers[i];
+      uint16_t *dest = &buffer[reg->address - block->start];
+      if (reg->address < block->start || reg->address + register_length(reg) > block->start + block->length) {
+        continue; // skipped by the plan
+      }
+
+      // a register the unit refuses spoils the whole request, so the others are read on their own
+      if (-1 == (exception && block->first != block->last ? read_block(ctx, type, reg->address, register_length(reg), dest) : ret)) {
+        LOG(LOG_DEBUG, "Reading register %" PRIu8 " (%s) failed, will retry", reg->address, reg->human_name);
+        retry_register(queue, type, reg, &states[i], false);
+      } else {
+        store_register(queue, type, reg, &states[i], decode_register(reg, dest));
+      }
+    }
+
+    publish_samples();
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Re-read registers which failed or were implausible, coalescing neighbours into as few requests as possible,
+ * until they all succeed or the time budget is spent. When a coalesced request fails, its registers are read on
+ * their own, so that an address the unit refuses does not spoil its neighbours.
+ */
+void retry_registers(modbus_t *ctx, RETRY_QUEUE *queue) {
+  const double deadline = monotonic_ms() + RETRY_BUDGET;
+
+  for (size_t round = 0; round < RETRY_ROUNDS && queue->size && monotonic_ms() < deadline; round++) {
+    const RETRY_QUEUE pending = *queue;
+    queue->size = 0;
+    current_slave->read_metric_retried_total += pending.size;
+
+    size_t first = 0;
+    size_t requests = 0;
+    while (first < pending.size) {
+      if (monotonic_ms() >= deadline) {
+        LOG(LOG_ERROR, "Retry budget of %ums exhausted", RETRY_BUDGET);
+        while (first < pending.size) {
+          queue->entries[queue->size++] = pending.entries[first++];
+        }
         break;
+      }
 
-      default:
-        return query_device_failed(ctx, "Unexpected register size");
+      execute_commands(ctx);
+
+      const RETRY *head = &pending.entries[first];
+      const int start = head->reg->address;
+      size_t last = first;
+      while (last + 1 < pending.size) {
+        const RETRY *next = &pending.entries[last + 1];
+        const int end = pending.entries[last].reg->address + register_length(pending.entries[last].reg);
+        if (next->type != head->type || next->reg->address - end > (int)RETRY_MAX_GAP ||
+            next->reg->address + register_length(next->reg) - start > MODBUS_MAX_READ_REGISTERS) {
+          break;
+        }
+        last++;
       }
 
-      if (-1 == ret) {
-        read_register_failed(&reg);
-      } else {
-        add_metric(reg.metric_name, *result);
+      const int length = pending.entries[last].reg->address + register_length(pending.entries[last].reg) - start;
+      uint16_t buffer[MODBUS_MAX_READ_REGISTERS] = {0};
+      const int ret = read_block(ctx, head->type, start, length, buffer);
+      const bool split = -1 == ret && first != last; // the request may have spanned an address the unit refuses
+      requests += split ? last - first + 2 : 1;
+
+      for (size_t index = first; index <= last; index++) {
+        const RETRY *retry = &pending.entries[index];
+        uint16_t *dest = &buffer[retry->reg->address - start];
+        if (-1 == (split ? read_block(ctx, retry->type, retry->reg->address, register_length(retry->reg), dest) : ret)) {
+          retry_register(queue, retry->type, retry->reg, retry->state, false);
+        } else {
+          store_register(queue, retry->type, retry->reg, retry->state, decode_register(retry->reg, dest));
+        }
       }
+      publish_samples();
+
+      first = last + 1;
     }
 
-    device_metrics.last_time_read_settings_at = now;
+    LOG(LOG_INFO, "Retried %zu registers in %zu requests, %zu left", pending.size, requests, queue->size);
   }
 
-  for (size_t index = 0; index < COUNT(input_registers); index++) {
-    const REGISTER reg = input_registers[index];
-    ssize_t ret = -1;
-    double result[2] = {0};
+  for (size_t index = 0; index < queue->size; index++) {
+    const RETRY *retry = &queue->entries[index];
+    if (retry->implausible) {
+      retry->state->rejected++;
+    }
+    read_register_failed(retry->reg);
+  }
+  queue->size = 0;
+}
 
-    switch (reg.register_size) {
-    case REGISTER_SINGLE:
-      ret = read_input_register_scaled_by(ctx, reg.address, result, reg.scale);
-      break;
+int query_modbus(modbus_t *ctx) {
+  free(current_slave->cycle_metrics);
+  current_slave->cycle_metrics = NULL;
+  current_slave->cycle_size = 0;
+  current_slave->cycle_published = 0;
+  current_slave->read_metric_failed_total = 0;
+  current_slave->read_metric_succeeded_total = 0;
+  current_slave->read_metric_retried_total = 0;
 
-    case REGISTER_DOUBLE:
-      ret = read_input_register_double_scaled_by(ctx, reg.address, result, reg.scale);
-      break;
+  RETRY_QUEUE queue = {.size = 0};
+  int code = EXIT_SUCCESS;
 
-    default:
-      return query_device_failed(ctx, "Unexpected register size");
+  const time_t now = time(NULL);
+
+  LOG(LOG_TRACE, "now - last_time_synced_at = %.0lfs", difftime(now, current_slave->last_time_synced_at));
+  if (difftime(now, current_slave->last_time_synced_at) > 1 * DAY) {
+    const uint64_t span = span_begin();
+    if (clock_sync(ctx)) {
+      LOG(LOG_INFO, "Synced time");
     }
+    span_end(span, "clock_sync", "slave", current_slave->slave_id);
 
-    if (-1 == ret) {
-      read_register_failed(&reg);
-    } else {
-      if (reg.address == 50 && *result == 0) {
-        // XXX: sometimes register 50 (energy_pv_total_kwh) is zero which messes up with statistics
-        // XXX: this is a bit of a hack and should be handled somewhere else if more sanity checks become needed
-        LOG(LOG_ERROR, "Discarding bogus register 50");
-        read_register_failed(&reg);
-      } else {
-        add_metric(reg.metric_name, *result);
-      }
+    current_slave->last_time_synced_at = now;
+  }
+
+  LOG(LOG_TRACE, "now - last_time_read_settings_at = %.0lfs", difftime(now, current_slave->last_time_read_settings_at));
+  if (difftime(now, current_slave->last_time_read_settings_at) > 1 * HOUR) {
+    code = read_registers(ctx, &queue, REGISTER_HOLDING, &current_slave->holding_plan, holding_registers, current_slave->holding_states);
+    if (code != EXIT_SUCCESS) {
+      return code;
     }
+
+    current_slave->last_time_read_settings_at = now;
+  }
+
+  code = read_registers(ctx, &queue, REGISTER_INPUT, &current_slave->input_plan, input_registers, current_slave->input_states);
+  if (code != EXIT_SUCCESS) {
+    return code;
   }
 
-  add_metric("read_metric_failed_total", (double)device_metrics.read_metric_failed_total);
-  add_metric("read_metric_succeeded_total", (double)device_metrics.read_metric_succeeded_total);
+  retry_registers(ctx, &queue);
+
+  push_metric("read_metric_failed_total", (double)current_slave->read_metric_failed_total);
+  push_metric("read_metric_succeeded_total", (double)current_slave->read_metric_succeeded_total);
+  push_metric("read_metric_retried_total", (double)current_slave->read_metric_retried_total);
+  push_metric("modbus_response_timeout_seconds", bus.response_timeout / 1e3);                           // NOLINT
+  push_metric("modbus_latency_seconds", bus.latency.mean / 1e3);                                        // NOLINT
+  push_metric("modbus_latency_p99_seconds", latency_percentile(&bus.latency, LATENCY_PERCENTILE) / 1e3); // NOLINT
+  push_metric("modbus_bus_utilization", bus.utilization);
+  push_metric("stale", 0); // 1 in metrics restored at startup, until this cycle replaces them
+
+  mtx_lock(&commands.mutex);
+  push_metric("command_queue_depth", (double)atomic_load(&commands.size));
+  push_metric("command_succeeded_total", (double)commands.succeeded_total);
+  push_metric("command_failed_total", (double)commands.failed_total);
+  push_metric("command_rejected_total", (double)commands.rejected_total);
+  push_metric("command_latency_seconds", commands.latency / 1e3); // NOLINT(readability-magic-numbers)
+  mtx_unlock(&commands.mutex);
+
+  if (metrics_pushing) {
+    metrics_pushing();
+  }
+
+  if (current_slave->read_metric_succeeded_total == 0) {
+    return EXIT_NO_METRICS;
+  }
 
-  return device_metrics.read_metric_succeeded_total == 0 ? EXIT_NO_METRICS : EXIT_SUCCESS;
+  publish_cycle();
+
+  return EXIT_SUCCESS;
 }
 
 static void stop_modbus_thread(void) { modbus_close(ctx); }
 
-int start_modbus_thread(char device_or_uri[static 1]) {
-  LOG(LOG_DEBUG, "Modbus thread running...");
+/**
+ * Set up one metrics store per unit, forgetting everything known about the previous ones
+ */
+static void configure_slaves(const modbus_config *config) {
+  const size_t count = config->slave_count > 0 ? (size_t)config->slave_count : 1;
+
+  for (size_t index = 0; index < MODBUS_MAX_SLAVES; index++) {
+    METRICS *metrics = &device_metrics[index];
+
+    mtx_lock(&metrics->mutex);
+    free(metrics->metrics);
+    metrics->metrics = NULL;
+    metrics->size = 0;
+    mtx_unlock(&metrics->mutex);
+
+    free(metrics->cycle_metrics);
+    metrics->cycle_metrics = NULL;
+    metrics->cycle_size = 0;
+    metrics->cycle_published = 0;
+    metrics->last_time_synced_at = 0;
+    metrics->last_time_read_settings_at = 0;
+    memset(metrics->holding_states, 0, sizeof(metrics->holding_states));
+    memset(metrics->input_states, 0, sizeof(metrics->input_states));
+    metrics->slave_id = config->slave_count > 0 && index < count ? config->slave_ids[index] : 1;
+    metrics->timeouts = 0;
+    metrics->failures = 0;
+    metrics->skip_until = 0;
+
+    memset(&metrics->capability, 0, sizeof(metrics->capability));
+    if (index < count && config->capability_cache[0] &&
+        capability_load(config->capability_cache, config->device_or_uri, metrics->slave_id, &metrics->capability)) {
+      LOG(LOG_ERROR, "Ignoring capability cache %s, run --scan again", config->capability_cache);
+    }
+    plan_slave(metrics);
+  }
 
-  if (atexit(stop_modbus_thread)) {
-    PERROR("Could not register cleanup routine");
-    return EXIT_FAILURE;
+  current_slave = device_metrics;
+  atomic_store(&slave_count, count);
+  for (size_t index = 0; index < count; index++) {
+    metrics_changed(index);
+  }
+}
+
+/**
+ * Must be called once before any thread accesses device_metrics
+ */
+int init_modbus(const modbus_config *config) {
+  for (size_t index = 0; index < MODBUS_MAX_SLAVES; index++) {
+    if (mtx_init(&device_metrics[index].mutex, mtx_plain) != thrd_success) {
+      PERROR("Could not initialize modbus mutex");
+      return EXIT_FAILURE;
+    }
   }
 
-  if (mtx_init(&device_metrics.mutex, mtx_plain) != thrd_success) {
+  if (mtx_init(&refresh.mutex, mtx_plain) != thrd_success || cnd_init(&refresh.requested) != thrd_success ||
+      cnd_init(&refresh.completed) != thrd_success || init_commands()) {
     PERROR("Could not initialize modbus mutex");
     return EXIT_FAILURE;
   }
 
+  configure_slaves(config);
+
+  return reload_init(&modbus_reload, &modbus_pending, sizeof(modbus_pending));
+}
+
+/**
+ * Whether transactions are addressed to units with modbus_set_slave(): always in RTU mode, and over TCP with slave_ids
+ */
+static bool modbus_selects_slaves(const modbus_config *config) {
+  return config->device_or_uri[0] == '/' || config->slave_count > 0;
+}
+
+/**
+ * Create a libmodbus context for the device of config, addressed to its first unit, and connect to it.
+ * The current context is left alone, opened is only set on success.
+ */
+static int open_modbus(const modbus_config *config, modbus_t **opened) {
+  const char *device_or_uri = config->device_or_uri;
+
   char modbus_tcp_host[256]; // NOLINT(readability-magic-numbers)
   int modbus_tcp_port = 0;
   if (device_or_uri[0] != '/') {
@@ -337,76 +1066,392 @@ int start_modbus_thread(char device_or_uri[static 1]) {
     sscanf(device_or_uri, "%255[^:]:%d", modbus_tcp_host, &modbus_tcp_port); // NOLINT(cert-err34-c)
 
     if (modbus_tcp_port < 1 || modbus_tcp_port > USHRT_MAX) {
-      return query_device_failed(ctx, "Invalid port number");
+      return query_device_failed(NULL, "Invalid port number");
     }
   }
 
+  modbus_t *context = NULL;
   if (modbus_tcp_port) {
-    ctx = modbus_new_tcp(modbus_tcp_host, modbus_tcp_port);
+    context = modbus_new_tcp(modbus_tcp_host, modbus_tcp_port);
   } else {
-    ctx = modbus_new_rtu(device_or_uri, MODBUS_BAUD, MODBUS_PARITY, MODBUS_DATA_BIT, MODBUS_STOP_BIT);
-    if (modbus_set_slave(ctx, 1)) { // required with RTU mode
-      return query_device_failed(ctx, "Set slave failed");
+    context = modbus_new_rtu(device_or_uri, MODBUS_BAUD, MODBUS_PARITY, MODBUS_DATA_BIT, MODBUS_STOP_BIT);
+  }
+
+  if (context == NULL) {
+    return query_device_failed(NULL, "Unable to create the libmodbus context");
+  }
+
+  const int slave_id = config->slave_count > 0 ? config->slave_ids[0] : 1;
+  if (modbus_selects_slaves(config) && modbus_set_slave(context, slave_id)) {
+    return query_device_failed(context, "Set slave failed");
+  }
+
+  if (modbus_set_debug(context, DEBUG)) {
+    return query_device_failed(context, "Set debug flag failed");
+  }
+
+  const double initial_timeout = fmin(fmax(MODBUS_RESPONSE_TIMEOUT / 1e3, config->response_timeout_min), config->response_timeout_max);
+  if (set_timeouts(context, initial_timeout)) {
+    return query_device_failed(context, "Set response timeout failed");
+  }
+
+  if (modbus_connect(context)) {
+    return query_device_failed(context, "Modbus connection failed");
+  }
+
+  *opened = context;
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Create the libmodbus context and connect to the device
+ */
+int connect_modbus(const modbus_config *config) {
+  const int code = open_modbus(config, &ctx);
+  if (code != EXIT_SUCCESS) {
+    ctx = NULL;
+    return code;
+  }
+
+  bus.select_slave = modbus_selects_slaves(config);
+  current_slave = device_metrics;
+
+  return EXIT_SUCCESS;
+}
+
+void disconnect_modbus(void) {
+  if (ctx) {
+    modbus_close(ctx);
+    modbus_free(ctx);
+    ctx = NULL;
+  }
+}
+
+/**
+ * Hand a new configuration over to the thread owning the Modbus connection
+ */
+void reload_modbus(const modbus_config *config) { reload_offer(&modbus_reload, config); }
+
+/**
+ * Whether switching from config to next changes the device or its units, which then start over with fresh metrics
+ */
+bool modbus_config_reconnects(const modbus_config *config, const modbus_config *next) {
+  return strcmp(config->device_or_uri, next->device_or_uri) != 0 || config->slave_count != next->slave_count ||
+         memcmp(config->slave_ids, next->slave_ids, sizeof(config->slave_ids)) != 0 ||
+         strcmp(config->capability_cache, next->capability_cache) != 0;
+}
+
+/**
+ * Switch to a new configuration, connecting to a new device first and only when it changed.
+ * The current device, its units and their metrics are kept untouched when the new one cannot be reached.
+ */
+int apply_modbus_config(modbus_config *config, const modbus_config *next) {
+  if (strcmp(config->device_or_uri, next->device_or_uri) != 0) {
+    LOG(LOG_INFO, "Switching from %s to %s...", config->device_or_uri, next->device_or_uri);
+    modbus_t *opened = NULL;
+    if (open_modbus(next, &opened) != EXIT_SUCCESS) {
+      LOG(LOG_ERROR, "Cannot connect to %s, keeping %s", next->device_or_uri, config->device_or_uri);
+      reload_reject(&modbus_reload);
+      return EXIT_SUCCESS;
+    }
+
+    disconnect_modbus();
+    ctx = opened;
+    memset(&bus.latency, 0, sizeof(bus.latency));
+  } else if (set_timeouts(ctx, fmin(fmax(bus.response_timeout, next->response_timeout_min), next->response_timeout_max))) {
+    PERROR("Set timeouts failed");
+  }
+
+  if (modbus_config_reconnects(config, next)) {
+    // different units have their own metrics and counters
+    bus.select_slave = modbus_selects_slaves(next);
+    configure_slaves(next);
+    if (select_slave(ctx, 0)) {
+      PERROR("Set slave failed");
     }
   }
 
-  if (ctx == NULL) {
-    return query_device_failed(ctx, "Unable to create the libmodbus context");
+  *config = *next;
+  LOG(LOG_INFO, "Modbus configuration reloaded");
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Wait up to one second for a consumer to ask for fresh metrics, executing commands as soon as they are queued.
+ * Returns true if a cycle should start right away.
+ */
+bool wait_for_refresh_request(void) {
+  struct timespec deadline;
+  timespec_get(&deadline, TIME_UTC);
+  deadline.tv_sec++;
+
+  mtx_lock(&refresh.mutex);
+  for (;;) {
+    while (!refresh.pending && !atomic_load(&commands.size) &&
+           cnd_timedwait(&refresh.requested, &refresh.mutex, &deadline) == thrd_success) {
+    }
+    if (refresh.pending || !atomic_load(&commands.size)) {
+      break;
+    }
+
+    mtx_unlock(&refresh.mutex);
+    execute_commands(ctx);
+    mtx_lock(&refresh.mutex);
+  }
+  const bool pending = refresh.pending;
+  mtx_unlock(&refresh.mutex);
+
+  return pending;
+}
+
+/**
+ * Queue a command from a consumer and wake the Modbus thread up if it is idle.
+ * In the event loop, the command is executed right away.
+ */
+COMMAND_STATUS submit_command(const int slave_id, char const metric_name[static 1], const double value) {
+  const size_t slave = find_slave(slave_id);
+  const COMMAND_STATUS status = slave == SIZE_MAX ? COMMAND_UNKNOWN : queue_command(slave, metric_name, value, monotonic_ms());
+  if (status != COMMAND_QUEUED) {
+    LOG(LOG_ERROR, "Command %s = %lf for slave %d refused (status = %d)", metric_name, value, slave_id, status);
+    return status;
+  }
+
+  LOG(LOG_DEBUG, "Queued command %s = %lf for slave %d", metric_name, value, slave_id);
+
+  mtx_lock(&refresh.mutex);
+  const bool inline_mode = refresh.inline_poll != NULL;
+  cnd_signal(&refresh.requested);
+  mtx_unlock(&refresh.mutex);
+
+  if (inline_mode) {
+    execute_commands(ctx);
   }
 
-  if (modbus_set_debug(ctx, DEBUG)) {
-    return query_device_failed(ctx, "Set debug flag failed");
+  return status;
+}
+
+int poll_modbus(const modbus_config *config);
+
+/**
+ * Called by consumers before reading metrics: in on-demand mode, stale metrics trigger a cycle (or join the one in
+ * flight) and the caller waits for its completion, so that concurrent consumers share a single cycle.
+ */
+void request_fresh_metrics(void) {
+  mtx_lock(&refresh.mutex);
+
+  if (refresh.max_age <= 0 || difftime(time(NULL), refresh.polled_at) <= refresh.max_age) {
+    mtx_unlock(&refresh.mutex);
+    return;
+  }
+
+  if (refresh.inline_poll) {
+    // single-threaded: nobody else can be polling right now
+    mtx_unlock(&refresh.mutex);
+    refresh.inline_poll(refresh.inline_context);
+    return;
+  }
+
+  const unsigned long target = refresh.cycles + 1;
+  if (!refresh.in_flight) {
+    refresh.pending = true;
+    cnd_signal(&refresh.requested);
+  }
+
+  struct timespec deadline;
+  timespec_get(&deadline, TIME_UTC);
+  deadline.tv_sec += REFRESH_DEADLINE;
+
+  LOG(LOG_DEBUG, "Waiting for fresh metrics...");
+  while (refresh.cycles < target && cnd_timedwait(&refresh.completed, &refresh.mutex, &deadline) == thrd_success) {
+  }
+  if (refresh.cycles < target) {
+    LOG(LOG_ERROR, "No fresh metrics after %ds, serving stale ones", REFRESH_DEADLINE);
+  }
+
+  mtx_unlock(&refresh.mutex);
+}
+
+/**
+ * Query one unit and publish its metrics. A unit which keeps failing is polled less and less often (up to every
+ * 2^SLAVE_MAX_BACKOFF rounds) so that it does not eat into the time of the others, SLAVE_SKIPPED in between.
+ */
+static int poll_slave(const size_t index) {
+  METRICS *metrics = &device_metrics[index];
+  if (bus.rounds < metrics->skip_until) {
+    LOG(LOG_DEBUG, "Skipping failing slave %d", metrics->slave_id);
+    return SLAVE_SKIPPED;
   }
 
-  if (modbus_set_response_timeout(ctx, 0, MODBUS_RESPONSE_TIMEOUT)) {
-    return query_device_failed(ctx, "Set response timeout failed");
+  if (select_slave(ctx, index)) {
+    return query_device_failed(NULL, "Set slave failed");
   }
 
-  if (modbus_connect(ctx)) {
-    return query_device_failed(ctx, "Modbus connection failed");
+  metrics->timeouts = 0;
+  const uint64_t span = span_begin();
+  const int result = query_modbus(ctx);
+  span_end(span, "query_modbus", "slave", metrics->slave_id);
+
+  if (result == EXIT_SUCCESS) {
+    metrics->failures = 0;
+  } else if (atomic_load(&slave_count) > 1) {
+    publish_cycle(); // only diagnostic metrics, the values of a unit which is gone expire
+    metrics->failures++;
+    metrics->skip_until = bus.rounds + (1UL << (metrics->failures < SLAVE_MAX_BACKOFF ? metrics->failures : SLAVE_MAX_BACKOFF));
+    LOG(LOG_ERROR, "Slave %d failed %u times in a row (code = %d)", metrics->slave_id, metrics->failures, result);
   }
 
+  return result;
+}
+
+/**
+ * Run one query cycle and publish its result in device_metrics.
+ * Units take turns on the line, starting with a different one each round so that none always comes last.
+ * Fails only when the single unit could not be queried: with several, failing units back off on their own and the
+ * others keep being served.
+ */
+int poll_modbus(const modbus_config *config) {
   struct timespec before, after; // NOLINT(readability-isolate-declaration)
 
-  while (keep_running) {
-    clock_gettime(CLOCK_REALTIME, &before);
-    LOG(LOG_INFO, "Querying device %s...", device_or_uri);
+  clock_gettime(CLOCK_REALTIME, &before);
+  LOG(LOG_INFO, "Querying device %s...", config->device_or_uri);
 
-    mtx_lock(&device_metrics.mutex);
-    int result = query_modbus(ctx);
-    mtx_unlock(&device_metrics.mutex);
+  mtx_lock(&refresh.mutex);
+  refresh.in_flight = true;
+  refresh.pending = false;
+  refresh.max_age = config->max_age;
+  mtx_unlock(&refresh.mutex);
 
-    if (result != EXIT_SUCCESS) {
-      PERROR("query_modbus() failed (code = %d)", result);
-      return result;
+  bus.metric_ttl = config->metric_ttl;
+
+  // the line is shared, so is its utilization: time spent in transactions from the start of a round to the next one
+  const double started_at = monotonic_ms();
+  if (bus.busy_since > 0) {
+    bus.utilization = fmin(bus.busy / (started_at - bus.busy_since), 1);
+  }
+  bus.busy = 0;
+  bus.busy_since = started_at;
+
+  const size_t count = atomic_load(&slave_count);
+  size_t succeeded = 0;
+  size_t metrics_succeeded = 0;
+  size_t metrics_failed = 0;
+  int result = EXIT_NO_METRICS;
+
+  for (size_t turn = 0; turn < count; turn++) {
+    const int code = poll_slave((bus.rounds + turn) % count);
+    if (code == SLAVE_SKIPPED) {
+      continue;
+    }
+    if (code == EXIT_SUCCESS) {
+      succeeded++;
+      metrics_succeeded += current_slave->read_metric_succeeded_total;
+      metrics_failed += current_slave->read_metric_failed_total;
+    } else if (result != EXIT_SUCCESS) {
+      result = code;
     }
+  }
+  if (succeeded) {
+    result = EXIT_SUCCESS;
+  }
+  bus.rounds++;
+
+  mtx_lock(&refresh.mutex);
+  refresh.in_flight = false;
+  refresh.cycles++;
+  refresh.polled_at = time(NULL);
+  cnd_broadcast(&refresh.completed);
+  mtx_unlock(&refresh.mutex);
+
+  if (result != EXIT_SUCCESS && count > 1) {
+    LOG(LOG_ERROR, "No slave answered this round (code = %d), trying again on the next one", result);
+    return EXIT_SUCCESS;
+  }
+  if (result != EXIT_SUCCESS) {
+    PERROR("query_modbus() failed (code = %d)", result);
+    return result;
+  }
+
+  tune_timeouts(ctx, config);
+
+  if (poll_completed) {
+    poll_completed(config);
+  }
+
+  clock_gettime(CLOCK_REALTIME, &after);
+  double const elapsed = after.tv_sec - before.tv_sec + (double)(after.tv_nsec - before.tv_nsec) / 1e9; // NOLINT
+
+  LOG(LOG_INFO, "Got %zu/%zu metrics from %zu/%zu slaves in %.1fs", metrics_succeeded, metrics_succeeded + metrics_failed, succeeded,
+      count, elapsed);
+
+  /*
+  LOG(LOG_TRACE, "last_time_synced_at = %ld, last_time_read_settings_at = %ld", current_slave->last_time_synced_at,
+      current_slave->last_time_read_settings_at);
+
+  for (size_t i = 0; i < current_slave->size; i++) {
+    METRIC metric = current_slave->metrics[i];
+    LOG(LOG_TRACE, "%s = %lf", metric.name, metric.value);
+  }
+  */
 
-    clock_gettime(CLOCK_REALTIME, &after);
-    double const elapsed = after.tv_sec - before.tv_sec + (double)(after.tv_nsec - before.tv_nsec) / 1e9; // NOLINT
+  return EXIT_SUCCESS;
+}
 
-    LOG(LOG_INFO, "Got %lu/%lu metrics in %.1fs", device_metrics.read_metric_succeeded_total,
-        device_metrics.read_metric_succeeded_total + device_metrics.read_metric_failed_total, elapsed);
+/**
+ * Poll until asked to stop, config follows the reloads which could be applied
+ */
+static int poll_until_stopped(modbus_config *config) {
+  modbus_config next;
 
-    /*
-    LOG(LOG_TRACE, "last_time_synced_at = %ld, last_time_read_settings_at = %ld", device_metrics.last_time_synced_at,
-        device_metrics.last_time_read_settings_at);
+  int result = connect_modbus(config);
+  if (result != EXIT_SUCCESS) {
+    return result;
+  }
 
-    for (size_t i = 0; i < device_metrics.size; i++) {
-      METRIC metric = device_metrics.metrics[i];
-      LOG(LOG_TRACE, "%s = %lf", metric.name, metric.value);
+  while (keep_running) {
+    result = poll_modbus(config);
+    if (result != EXIT_SUCCESS) {
+      return result;
     }
-    */
 
-    LOG(LOG_INFO, "Waiting %d seconds...", REFRESH_PERIOD);
-    for (size_t i = 0; i < REFRESH_PERIOD; i++) {
-      sleep(1); // NOLINT(concurrency-mt-unsafe)
+    LOG(LOG_INFO, "Waiting %d seconds...", config->refresh_period);
+    for (int i = 0; i < config->refresh_period; i++) {
+      if (wait_for_refresh_request()) {
+        break; // in on-demand mode, refresh_period is only the background rate
+      }
       if (!keep_running) {
         return EXIT_SUCCESS;
       }
+      if (reload_take(&modbus_reload, &next)) {
+        if ((result = apply_modbus_config(config, &next)) != EXIT_SUCCESS) {
+          return result;
+        }
+        break; // start over with the new settings
+      }
     }
   }
 
   return EXIT_SUCCESS;
 }
 
+int start_modbus_thread(void *config_ptr) {
+  span_thread("MDBS");
+  LOG(LOG_DEBUG, "Modbus thread running...");
+
+  modbus_config config = *(const modbus_config *)config_ptr;
+
+  if (atexit(stop_modbus_thread)) {
+    PERROR("Could not register cleanup routine");
+    return EXIT_FAILURE;
+  }
+
+  const int result = poll_until_stopped(&config);
+  if (poll_stopped) {
+    poll_stopped(&config);
+  }
+
+  return result;
+}
+
 #endif /* GROWATT_MODBUS_H */
@@ -1,148 +1,509 @@
+#ifndef GROWATT_MQTT_H
+#define GROWATT_MQTT_H
+
 #include <inttypes.h>
 #include <mosquitto.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h> // sleep()
+#include <time.h>
 
 #include "growatt.h"
 #include "log.h"
 #include "modbus.h"
+#include "reload.h"
+#include "sink.h"
+
+#undef LOG_TAG
+#define LOG_TAG "33m[MQTT] "
 
 #define TOPIC_PREFIX "homeassistant/sensor/growatt"
+#define COMMAND_TOPICS "homeassistant/sensor/+/set/+"
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
 
 enum {
   MQTT_KEEPALIVE = 60U,
   RESPONSE_SIZE = 8192U,
-  PUBLISH_PERIOD = 15U, // seconds
+  PUBLISH_PERIOD = 15U,        // seconds
+  MQTT_WAIT = 1000,            // ms in between two checks for reloads and exits
+  MQTT_CONNACK_TIMEOUT = 5000, // ms a broker switched to upon a reload has to accept the connection
+  MQTT_CONNACK_PERIOD = 100,   // ms
   MQTT_CONFIG_SIZE = 128U,
   MQTT_METRIC_ID_SIZE = 128U,
   MQTT_METRIC_PAYLOAD_SIZE = 2048U,
+  MQTT_COMMAND_PAYLOAD_SIZE = 32U,
 };
 
 typedef struct __attribute__((aligned(32))) {
-  const char *host;
+  char host[CONFIG_STRING_SIZE];
   int port;
-  const char *username;
-  const char *password;
+  char username[CONFIG_STRING_SIZE];
+  char password[CONFIG_STRING_SIZE];
   int id;
+  /** Also publish each value on its own topic as soon as it is read, rather than only every PUBLISH_PERIOD */
+  int stream;
+  /** Accept setting writes published on the /set/ topics, by anyone allowed to publish to the broker */
+  int allow_commands;
+  SINK_POLICY queue_policy;
+  int queue_depth;
 } mqtt_config;
 
+/**
+ * What the callbacks of a client need, which outlives the configuration it was created from
+ */
+typedef struct {
+  int id;
+  /** CONNACK code, -1 until the broker answered */
+  atomic_int connack;
+  /** Hash of the discovery payloads published on the current connection, 0 when none were */
+  _Atomic uint64_t discovery_hash;
+  /** Subscribe to the /set/ topics, see mqtt_config */
+  bool allow_commands;
+  /** Created upon a reload: the current client is kept if this one is refused, rather than exiting */
+  bool reloaded;
+} MQTT_SESSION;
+
 // NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
 static struct mosquitto *client = NULL;
 
+// NOLINTBEGIN(cppcoreguidelines-avoid-non-const-global-variables)
+static bool mqtt_threaded = true; // false when driven by the event loop instead of mosquitto_loop_start()
+static MQTT_SESSION mqtt_sessions[2]; // of the client, and of the one replacing it upon a reload
+static size_t mqtt_session;           // index of the session of client
+static SINK mqtt_sink = {.wakeup = -1};
+static SNAPSHOT *mqtt_latest[MODBUS_MAX_SLAVES]; // belongs to the thread owning the client
+static mqtt_config mqtt_pending;
+static RELOAD mqtt_reload;
+// NOLINTEND(cppcoreguidelines-avoid-non-const-global-variables)
+
+/**
+ * Device part of topics and ids: "<id>" with a single unit, "<id>_<slave_id>" with several ones
+ */
+static void device_key(char dest[static MQTT_METRIC_ID_SIZE], const int id, const size_t slave) {
+  if (atomic_load(&slave_count) > 1) {
+    snprintf(dest, MQTT_METRIC_ID_SIZE, "%d_%d", id, device_metrics[slave].slave_id);
+  } else {
+    snprintf(dest, MQTT_METRIC_ID_SIZE, "%d", id);
+  }
+}
+
+void disconnect_mqtt(void) {
+  if (client) {
+    if (mqtt_threaded) {
+      mosquitto_loop_stop(client, true);
+    }
+    mosquitto_disconnect(client);
+    mosquitto_destroy(client);
+    client = NULL;
+  }
+}
+
 static void stop_mqtt_thread(void) {
-  mosquitto_disconnect(client);
-  mosquitto_destroy(client);
+  disconnect_mqtt();
 
   mosquitto_lib_cleanup();
 }
 
-void connection_callback(struct mosquitto *_mosq, void *_obj, int code) { // NOLINT(misc-unused-parameters)
+/**
+ * Publish the values of snapshot read since the previous one, on "<prefix>_<device>/<metric_name>"
+ */
+static void stream_metrics(const mqtt_config *config, const SNAPSHOT *snapshot, const SNAPSHOT *previous) {
+  char device[MQTT_METRIC_ID_SIZE];
+  char topic[MQTT_METRIC_ID_SIZE * 2 + METRIC_BUFFER_SIZE];
+  char payload[MQTT_COMMAND_PAYLOAD_SIZE];
+  int count = 0;
+
+  device_key(device, config->id, snapshot->slave); // the units may have changed since connecting
+
+  const uint64_t span = span_begin();
+  for (size_t i = 0; i < snapshot->size; i++) {
+    const METRIC *metric = &snapshot->metrics[i];
+    if (snapshot_fresh(previous, metric, i)) {
+      snprintf(topic, sizeof(topic), "%s_%s/%s", TOPIC_PREFIX, device, metric->name);
+      snprintf(payload, sizeof(payload), "%lf", metric->value);
+      mosquitto_publish(client, NULL, topic, (int)strlen(payload), payload, 0 /* QoS */, false /* retain */);
+      count++;
+    }
+  }
+  span_end(span, "mqtt_stream", "metrics", count);
+}
+
+/**
+ * Take the snapshots queued for MQTT, streaming their new values if enabled
+ */
+void mqtt_collect(const mqtt_config *config) {
+  SNAPSHOT *snapshot = NULL;
+  while ((snapshot = sink_take(&mqtt_sink))) {
+    if (config->stream && client) {
+      stream_metrics(config, snapshot, mqtt_latest[snapshot->slave]);
+    }
+    snapshot_keep(mqtt_latest, snapshot);
+  }
+}
+
+int init_mqtt(const mqtt_config *config) {
+  mosquitto_lib_init();
+
+  if (config->port && sink_open(&mqtt_sink, "mqtt", config->queue_policy, config->queue_depth)) {
+    return EXIT_FAILURE;
+  }
+
+  return reload_init(&mqtt_reload, &mqtt_pending, sizeof(mqtt_pending));
+}
+
+/**
+ * FNV-1a, to tell whether discovery payloads changed
+ */
+static uint64_t hash_string(uint64_t hash, char const string[static 1]) {
+  for (const char *c = string; *c; c++) {
+    hash = (hash ^ (uint8_t)*c) * FNV_PRIME;
+  }
+  return hash;
+}
+
+/**
+ * Build Home Assistant discovery payloads, one device per unit, and publish them (retained) over mosq unless NULL.
+ * Returns a hash of the payloads.
+ */
+static uint64_t discovery_payloads(struct mosquitto *mosq, const int id) {
+  char payload[MQTT_METRIC_PAYLOAD_SIZE];
+  char device[MQTT_METRIC_ID_SIZE];
+  char unique_id[MQTT_METRIC_ID_SIZE * 2];
+  char topic[sizeof(unique_id) + sizeof("homeassistant/sensor/%s/config")];
+  uint64_t hash = FNV_OFFSET_BASIS;
+
+  for (size_t slave = 0; slave < atomic_load(&slave_count); slave++) {
+    device_key(device, id, slave);
+
+    for (size_t index = 0; index < COUNT(input_registers); index++) {
+      const REGISTER reg = input_registers[index];
+
+      snprintf(unique_id, sizeof(unique_id), "growatt_%s_%s", device, reg.metric_name);
+
+      // don't include empty device_class otherwise https://www.home-assistant.io/integrations/mqtt will throw errors in the logs
+      if (strlen(reg.device_class) > 0) {
+        sprintf(payload,
+                "{\"device_class\":\"%s\",\"state_class\":\"%s\",\"state_topic\":\"%s_%s/state\",\"unit_of_measurement\":\"%s\","
+                "\"value_template\":\"{{value_json.%s}}\",\"name\":\"%s\",\"unique_id\":\"%s\","
+                "\"device\":{\"identifiers\":[\"%s\"],\"name\":\"Growatt %s\",\"manufacturer\":\"Growatt\"}}",
+                reg.device_class, reg.state_class, TOPIC_PREFIX, device, reg.unit, reg.metric_name, reg.human_name, unique_id, device, device);
+      } else {
+        sprintf(payload,
+                "{\"state_class\":\"%s\",\"state_topic\":\"%s_%s/state\",\"unit_of_measurement\":\"%s\","
+                "\"value_template\":\"{{value_json.%s}}\",\"name\":\"%s\",\"unique_id\":\"%s\","
+                "\"device\":{\"identifiers\":[\"%s\"],\"name\":\"Growatt %s\",\"manufacturer\":\"Growatt\"}}",
+                reg.state_class, TOPIC_PREFIX, device, reg.unit, reg.metric_name, reg.human_name, unique_id, device, device);
+      }
+
+      sprintf(topic, "homeassistant/sensor/%s/config", unique_id);
+      hash = hash_string(hash_string(hash, topic), payload);
+      if (mosq) {
+        mosquitto_publish(mosq, NULL, topic, (int)strlen(payload), payload, 0, true);
+      }
+    }
+  }
+
+  return hash;
+}
+
+/**
+ * Publish discovery payloads over the connection of session, unless the very same ones were already published on it.
+ * Every new connection publishes them again: the broker may have lost retained messages (or be another one).
+ */
+static void publish_discovery(struct mosquitto *mosq, MQTT_SESSION *session) {
+  const uint64_t hash = discovery_payloads(NULL, session->id);
+  if (hash == atomic_load(&session->discovery_hash)) {
+    return;
+  }
+
+  const uint64_t span = span_begin();
+  discovery_payloads(mosq, session->id);
+  span_end(span, "mqtt_discovery", NULL, 0);
+  atomic_store(&session->discovery_hash, hash);
+  LOG(LOG_INFO, "Discovery payloads published");
+}
+
+void connection_callback(struct mosquitto *mosq, void *session_ptr, int code) {
+  MQTT_SESSION *session = session_ptr;
+  atomic_store(&session->connack, code);
+
   if (code) {
-    LOG(LOG_ERROR, "Cannot connect to broker: %s (%d)\n", mosquitto_connack_string(code), code);
+    LOG(LOG_ERROR, "Cannot connect to broker: %s (%d)", mosquitto_connack_string(code), code);
+    if (session->reloaded) {
+      return; // see apply_mqtt_config()
+    }
+    if (!mqtt_threaded) {
+      keep_running = 0;
+      return;
+    }
     stop_mqtt_thread();
     thrd_exit(code);
   }
+
+  atomic_store(&session->discovery_hash, 0);
+  publish_discovery(mosq, session);
+
+  // subscribing again upon each (re)connection since the session is not persistent, to the commands of any device
+  // (wildcards span whole levels) so that a reload changing the units needs no new subscription
+  if (session->allow_commands && mosquitto_subscribe(mosq, NULL, COMMAND_TOPICS, 1 /* QoS */) != MOSQ_ERR_SUCCESS) {
+    LOG(LOG_ERROR, "Cannot subscribe to %s", COMMAND_TOPICS);
+  }
 }
 
-int start_mqtt_thread(void *config_ptr) {
-  if (atexit(stop_mqtt_thread)) {
-    PERROR("Could not register cleanup routine");
-    return EXIT_FAILURE;
+/**
+ * Queue the setting write received on "<prefix>_<device>/set/<metric_name>" with the new value as payload
+ */
+// NOLINTNEXTLINE(misc-unused-parameters)
+void message_callback(struct mosquitto *_mosq, void *session_ptr, const struct mosquitto_message *message) {
+  const MQTT_SESSION *session = session_ptr;
+  if (!session->allow_commands) {
+    return; // not subscribed then, never act on a message delivered anyway
   }
 
-  mqtt_config *config = (mqtt_config *)config_ptr;
+  // matched against the units polled now rather than when subscribing, which a reload may have changed since
+  char device[MQTT_METRIC_ID_SIZE];
+  char prefix[MQTT_METRIC_ID_SIZE * 2];
+  size_t slave = 0;
+  for (; slave < atomic_load(&slave_count); slave++) {
+    device_key(device, session->id, slave);
+    snprintf(prefix, sizeof(prefix), "%s_%s/set/", TOPIC_PREFIX, device);
+    if (!strncmp(message->topic, prefix, strlen(prefix))) {
+      break;
+    }
+  }
+  char payload[MQTT_COMMAND_PAYLOAD_SIZE] = {0};
 
-  mosquitto_lib_init();
+  if (slave == atomic_load(&slave_count)) {
+    LOG(LOG_DEBUG, "Ignoring command on %s, not for one of our units", message->topic);
+    return;
+  }
+  if (message->payloadlen <= 0 || message->payloadlen >= (int)sizeof(payload)) {
+    LOG(LOG_ERROR, "Ignoring command on %s", message->topic);
+    return;
+  }
+  memcpy(payload, message->payload, (size_t)message->payloadlen);
 
-  client = mosquitto_new(NULL, true, NULL);
-  if (!client) {
+  char *end = NULL;
+  const double value = strtod(payload, &end);
+  if (end == payload || *end != '\0') {
+    LOG(LOG_ERROR, "Ignoring command on %s: invalid value %s", message->topic, payload);
+    return;
+  }
+
+  submit_command(device_metrics[slave].slave_id, message->topic + strlen(prefix), value);
+}
+
+/**
+ * Create a client for session and connect it to the broker, the broker accepts it (or not) later on
+ */
+static struct mosquitto *open_mqtt(const mqtt_config *config, MQTT_SESSION *session, const bool reloaded) {
+  session->id = config->id;
+  session->allow_commands = config->allow_commands;
+  session->reloaded = reloaded;
+  atomic_store(&session->connack, -1);
+  atomic_store(&session->discovery_hash, 0);
+
+  struct mosquitto *mosq = mosquitto_new(NULL, true, session);
+  if (!mosq) {
     PERROR("Cannot create mosquitto client instance");
-    return EXIT_FAILURE;
+    return NULL;
   }
 
-  mosquitto_connect_callback_set(client, connection_callback);
+  mosquitto_connect_callback_set(mosq, connection_callback);
+  mosquitto_message_callback_set(mosq, message_callback);
 
   assert(strlen(config->username) > 0);
   assert(strlen(config->password) > 0);
-  if (mosquitto_username_pw_set(client, config->username, config->password) != MOSQ_ERR_SUCCESS) {
+  if (mosquitto_username_pw_set(mosq, config->username, config->password) != MOSQ_ERR_SUCCESS) {
     LOG(LOG_ERROR, "Cannot set username/password");
-    return EXIT_FAILURE;
+    mosquitto_destroy(mosq);
+    return NULL;
   }
 
   assert(strlen(config->host) > 0);
-  if (mosquitto_connect(client, config->host, config->port, MQTT_KEEPALIVE) != MOSQ_ERR_SUCCESS) {
+  if (mosquitto_connect(mosq, config->host, config->port, MQTT_KEEPALIVE) != MOSQ_ERR_SUCCESS) {
     PERROR("MQTT client could not connect to %s:%" PRIu16, config->host, config->port);
+    mosquitto_destroy(mosq);
+    return NULL;
+  }
+
+  return mosq;
+}
+
+/**
+ * Create the MQTT client and connect to the broker
+ */
+int connect_mqtt(const mqtt_config *config) {
+  client = open_mqtt(config, &mqtt_sessions[mqtt_session], false);
+  if (!client) {
     return EXIT_FAILURE;
   }
 
-  if (mosquitto_loop_start(client) != MOSQ_ERR_SUCCESS) { // without this statement, the callback is not called upon connection
+  // without this statement, the callback is not called upon connection (the event loop reads the socket itself)
+  if (mqtt_threaded && mosquitto_loop_start(client) != MOSQ_ERR_SUCCESS) {
     PERROR("Unable to start loop");
     return EXIT_FAILURE;
   }
 
   LOG(LOG_INFO, "Connected to the MQTT broker");
 
-  char payload[MQTT_METRIC_PAYLOAD_SIZE];
-  char unique_id[MQTT_METRIC_ID_SIZE];
-  char topic[MQTT_METRIC_ID_SIZE + sizeof("homeassistant/sensor/%s/config")];
+  return EXIT_SUCCESS;
+}
 
-  for (size_t index = 0; index < COUNT(input_registers); index++) {
-    const REGISTER reg = input_registers[index];
-
-    sprintf(unique_id, "growatt_%" PRIu8 "_%s", config->id, reg.metric_name);
-
-    // don't include empty device_class otherwise https://www.home-assistant.io/integrations/mqtt will throw errors in the logs
-    if (strlen(reg.device_class) > 0) {
-      sprintf(payload,
-              "{\"device_class\":\"%s\",\"state_class\":\"%s\",\"state_topic\":\"%s_%" PRIu8 "/state\",\"unit_of_measurement\":\"%s\","
-              "\"value_template\":\"{{value_json.%s}}\",\"name\":\"%s\",\"unique_id\":\"%s\","
-              "\"device\":{\"identifiers\":[\"%" PRIu8 "\"],\"name\":\"Growatt %" PRIu8 "\",\"manufacturer\":\"Growatt\"}}",
-              reg.device_class, reg.state_class, TOPIC_PREFIX, config->id, reg.unit, reg.metric_name, reg.human_name, unique_id, config->id, config->id);
-    } else {
-      sprintf(payload,
-              "{\"state_class\":\"%s\",\"state_topic\":\"%s_%" PRIu8 "/state\",\"unit_of_measurement\":\"%s\","
-              "\"value_template\":\"{{value_json.%s}}\",\"name\":\"%s\",\"unique_id\":\"%s\","
-              "\"device\":{\"identifiers\":[\"%" PRIu8 "\"],\"name\":\"Growatt %" PRIu8 "\",\"manufacturer\":\"Growatt\"}}",
-              reg.state_class, TOPIC_PREFIX, config->id, reg.unit, reg.metric_name, reg.human_name, unique_id, config->id, config->id);
-    }
+/**
+ * Publish all current metrics as one JSON state payload per unit
+ */
+void publish_state(const mqtt_config *config) {
+  static char metrics[RESPONSE_SIZE]; // off the stack, states are published by one thread only
+  char buffer[METRIC_BUFFER_SIZE * 2];
+  char device[MQTT_METRIC_ID_SIZE];
+  char topic[MQTT_METRIC_ID_SIZE + sizeof("homeassistant/sensor/%s/config")];
 
-    sprintf(topic, "homeassistant/sensor/%s/config", unique_id);
-    mosquitto_publish(client, NULL, topic, (int)strlen(payload), payload, 0, true);
-  }
+  request_fresh_metrics();
+  mqtt_collect(config);
+  publish_discovery(client, &mqtt_sessions[mqtt_session]); // the units may have changed since
+  const int64_t now = realtime_ms();
 
-  char metrics[RESPONSE_SIZE] = {0};
-  char buffer[RESPONSE_SIZE] = {0};
+  for (size_t slave = 0; slave < atomic_load(&slave_count); slave++) {
+    const SNAPSHOT *snapshot = mqtt_latest[slave];
 
-  while (1) {
     strlcpy(metrics, "{", RESPONSE_SIZE);
 
-    mtx_lock(&device_metrics.mutex);
-    for (size_t i = 0; i < device_metrics.size; i++) {
-      METRIC metric = device_metrics.metrics[i];
+    for (size_t i = 0; snapshot && i < snapshot->size; i++) {
+      const METRIC *metric = &snapshot->metrics[i];
+      if (metric_expired(metric, now)) {
+        continue;
+      }
 
-      snprintf(buffer, sizeof(buffer), "\"%s\":%lf,", metric.name, metric.value);
+      snprintf(buffer, sizeof(buffer), "\"%s\":%lf,", metric->name, metric->value);
       strlcat(metrics, buffer, RESPONSE_SIZE);
     }
-    mtx_unlock(&device_metrics.mutex);
 
     metrics[strlen(metrics) - 1] = '}'; // replace last ','
 
     if (strlen(metrics) > 1) { // don't publish empty metrics
-      sprintf(topic, "%s_%" PRIu8 "/state", TOPIC_PREFIX, config->id);
+      device_key(device, config->id, slave);
+      sprintf(topic, "%s_%s/state", TOPIC_PREFIX, device);
       LOG(LOG_INFO, "Publishing status (%zu bytes) to %s...", strlen(metrics), topic);
+      const uint64_t span = span_begin();
       mosquitto_publish(client, NULL, topic, (int)strlen(metrics), metrics, 0 /* QoS */, false /* retain */);
+      span_end(span, "mqtt_publish_state", "slave", snapshot->slave_id);
     }
+  }
+}
+
+/**
+ * Hand a new configuration over to the thread owning the MQTT client
+ */
+void reload_mqtt(const mqtt_config *config) { reload_offer(&mqtt_reload, config); }
+
+/**
+ * Whether switching to next needs a new connection, rather than only new queue settings
+ */
+bool mqtt_config_reconnects(const mqtt_config *config, const mqtt_config *next) {
+  mqtt_config connection = *next;
+  connection.queue_policy = config->queue_policy;
+  connection.queue_depth = config->queue_depth;
+  return memcmp(config, &connection, sizeof(connection)) != 0;
+}
+
+/**
+ * Connect a second client to the broker of next and wait for it to accept the connection (e.g. the credentials),
+ * returns NULL if it does not within MQTT_CONNACK_TIMEOUT
+ */
+static struct mosquitto *connect_candidate(const mqtt_config *next, MQTT_SESSION *session) {
+  struct mosquitto *candidate = open_mqtt(next, session, true);
+  if (!candidate) {
+    return NULL;
+  }
+
+  // driven from here until accepted, then by its own thread (or by the event loop) once it replaces the client
+  const double deadline = monotonic_ms() + MQTT_CONNACK_TIMEOUT;
+  while (atomic_load(&session->connack) < 0 && monotonic_ms() < deadline && keep_running) {
+    if (mosquitto_loop(candidate, MQTT_CONNACK_PERIOD, 1) != MOSQ_ERR_SUCCESS) {
+      break;
+    }
+  }
+
+  if (atomic_load(&session->connack) != 0) {
+    mosquitto_destroy(candidate);
+    return NULL;
+  }
+
+  return candidate;
+}
+
+/**
+ * Switch to a new configuration, connecting to the new broker first if needed.
+ * The current connection is kept when the new broker cannot be reached or refuses the connection.
+ */
+int apply_mqtt_config(mqtt_config *config, const mqtt_config *next) {
+  sink_configure(&mqtt_sink, next->queue_policy, next->queue_depth);
+  if (!mqtt_config_reconnects(config, next)) {
+    *config = *next;
+    LOG(LOG_INFO, "MQTT configuration reloaded");
+    return EXIT_SUCCESS;
+  }
+
+  LOG(LOG_INFO, "Connecting to %s:%d...", next->host, next->port);
+  const size_t session = 1 - mqtt_session;
+  struct mosquitto *candidate = connect_candidate(next, &mqtt_sessions[session]);
+  if (!candidate) {
+    LOG(LOG_ERROR, "Cannot connect to %s:%d, keeping %s:%d", next->host, next->port, config->host, config->port);
+    reload_reject(&mqtt_reload);
+    return EXIT_SUCCESS;
+  }
+
+  disconnect_mqtt();
+  client = candidate;
+  mqtt_session = session;
+  if (mqtt_threaded && mosquitto_loop_start(client) != MOSQ_ERR_SUCCESS) {
+    PERROR("Unable to start loop");
+    return EXIT_FAILURE;
+  }
+  *config = *next;
+
+  LOG(LOG_INFO, "MQTT configuration reloaded");
+
+  return EXIT_SUCCESS;
+}
+
+int start_mqtt_thread(void *config_ptr) {
+  span_thread("MQTT");
+  if (atexit(stop_mqtt_thread)) {
+    PERROR("Could not register cleanup routine");
+    return EXIT_FAILURE;
+  }
+
+  mqtt_config config = *(const mqtt_config *)config_ptr;
+  mqtt_config next;
+
+  if (connect_mqtt(&config)) {
+    return EXIT_FAILURE;
+  }
+
+  while (1) {
+    publish_state(&config);
 
     LOG(LOG_DEBUG, "Waiting %u seconds...", PUBLISH_PERIOD);
-    for (size_t i = 0; i < PUBLISH_PERIOD; i++) {
-      sleep(1); // NOLINT(concurrency-mt-unsafe)
+    const time_t publish_at = time(NULL) + PUBLISH_PERIOD;
+    while (time(NULL) < publish_at) {
+      sink_wait(&mqtt_sink, MQTT_WAIT);
+      mqtt_collect(&config);
       if (!keep_running) {
         return EXIT_SUCCESS;
       }
+      if (reload_take(&mqtt_reload, &next) && apply_mqtt_config(&config, &next)) {
+        return EXIT_FAILURE;
+      }
     }
   }
 
   return EXIT_SUCCESS;
 }
+
+#endif /* GROWATT_MQTT_H */
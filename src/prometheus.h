@@ -1,82 +1,595 @@
+#ifndef GROWATT_PROMETHEUS_H
+#define GROWATT_PROMETHEUS_H
+
 #include <arpa/inet.h> // HTTP stuff
-#include <bsd/string.h>
+#include <ctype.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
 #include <unistd.h> // close()
 
 #include "log.h"
 #include "modbus.h"
+#include "reload.h"
+#include "sink.h"
+
+#undef LOG_TAG
+#define LOG_TAG "35m[PRMT] "
 
 enum {
   BACKLOG = 10,              // passed to listen()
   MINIMUM_REQUEST_SIZE = 16, // bytes
   REQUEST_BUFFER_SIZE = 1024,
+  RESPONSE_HEADER_SIZE = 256, // bytes reserved for the status line and headers of a response
+  HTTP_METHOD_SIZE = 8,       // "DELETE" and a terminator
+  SELECTOR_MAX_NAMES = 16U,   // name[]= and match[]= parameters of a request, each
+  EXPOSITION_MAX_FAMILIES = 128U,
+  EXPOSITION_MAX_SAMPLES = EXPOSITION_MAX_FAMILIES * MODBUS_MAX_SLAVES,
 };
 
+#define EXPOSED_PREFIX "growatt_"
+#define EXPOSED_NAME_SIZE (sizeof(EXPOSED_PREFIX) + MAX_METRIC_LENGTH)
+
 typedef struct {
   int port;
+  /** Accept setting writes (POST /settings/...), which are not authenticated */
+  int allow_commands;
+  SINK_POLICY queue_policy;
+  int queue_depth;
 } prometheus_config;
 
 #define PROMETHEUS_CONTENT_TYPE "text/plain; version=0.0.4; charset=utf-8"
-#define REQUEST_PROMETHEUS "GET /metrics"
+#define PATH_METRICS "/metrics" // optionally followed by "/fast", "/slow" or "/device/<slave_id>"
+#define PATH_TRACE "/trace"
+#define PATH_SETTINGS "/settings/" // followed by "<metric_name>?value=<value>[&slave=<slave_id>]"
+
+/**
+ * Request line of an HTTP request, split into its parts
+ */
+typedef struct {
+  char method[HTTP_METHOD_SIZE];
+  char path[REQUEST_BUFFER_SIZE];
+  /** Still URL-encoded, without the "?" */
+  char query[REQUEST_BUFFER_SIZE];
+} HTTP_REQUEST;
+
+/**
+ * Scrape jobs can ask for the metrics which change quickly (power, voltages...) more often than the rest
+ */
+typedef enum {
+  METRIC_GROUP_FAST = 1U << 0U, // input registers which are gauges
+  METRIC_GROUP_SLOW = 1U << 1U, // settings, energy totals and the exporter's own metrics
+  METRIC_GROUP_ALL = METRIC_GROUP_FAST | METRIC_GROUP_SLOW,
+} METRIC_GROUP;
+
+/**
+ * Part of the exposition a scrape asks for: metrics of the groups which match one of the names or patterns (all of
+ * them without any), sampled on one unit or all of them
+ */
+typedef struct {
+  unsigned groups;
+  /** Index of the unit in device_metrics, SIZE_MAX for all */
+  size_t slave;
+  /** Exposed names, from name[]= */
+  char names[SELECTOR_MAX_NAMES][EXPOSED_NAME_SIZE];
+  size_t name_count;
+  /** fnmatch(3) patterns of exposed names, from match[]= */
+  char patterns[SELECTOR_MAX_NAMES][EXPOSED_NAME_SIZE];
+  size_t pattern_count;
+} SELECTOR;
+
+/**
+ * Lines of the exposition, as offsets into its text
+ */
+typedef struct {
+  size_t start;
+  size_t length;
+} SLICE;
+
+typedef struct {
+  char name[EXPOSED_NAME_SIZE];
+  METRIC_GROUP group;
+  /** "# TYPE" line */
+  SLICE type;
+  /** Its samples, consecutive in EXPOSITION.samples */
+  size_t first_sample;
+  size_t sample_count;
+} FAMILY;
 
-// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+typedef struct {
+  SLICE line;
+  /** Index of the unit in device_metrics */
+  size_t slave;
+} SAMPLE;
+
+/**
+ * Text served on /metrics, built again only once a snapshot arrives or a sample expires; filtered scrapes copy the
+ * lines they want out of it
+ */
+typedef struct {
+  char text[RESPONSE_BUFFER_SIZE - RESPONSE_HEADER_SIZE];
+  size_t length;
+  FAMILY families[EXPOSITION_MAX_FAMILIES];
+  size_t family_count;
+  SAMPLE samples[EXPOSITION_MAX_SAMPLES];
+  size_t sample_count;
+  /** Time the first sample served expires, in ms since the epoch */
+  int64_t expires_at;
+  bool built;
+} EXPOSITION;
+
+// NOLINTBEGIN(cppcoreguidelines-avoid-non-const-global-variables)
 static int server_socket;
+static int prometheus_wakeup = -1; // eventfd interrupting the thread waiting for requests
+static prometheus_config prometheus_pending;
+static RELOAD prometheus_reload;
+static EXPOSITION exposition; // belongs to the thread serving requests, only one is served at a time
+static SINK prometheus_sink = {.wakeup = -1};
+static SNAPSHOT *prometheus_latest[MODBUS_MAX_SLAVES]; // what the exposition is built from
+// NOLINTEND(cppcoreguidelines-avoid-non-const-global-variables)
 
-int set_response(char *response) {
-  char metrics[RESPONSE_BUFFER_SIZE] = {0};
-  char buffer[RESPONSE_BUFFER_SIZE] = {0};
-  int code = EXIT_SUCCESS;
+/**
+ * Look metric name up in count snapshots (which may be NULL), ignoring expired samples
+ */
+static const METRIC *find_metric(SNAPSHOT *const *snapshots, const size_t count, char const name[static 1], const int64_t now) {
+  for (size_t slave = 0; slave < count; slave++) {
+    for (size_t i = 0; snapshots[slave] && i < snapshots[slave]->size; i++) {
+      if (!strcmp(snapshots[slave]->metrics[i].name, name) && !metric_expired(&snapshots[slave]->metrics[i], now)) {
+        return &snapshots[slave]->metrics[i];
+      }
+    }
+  }
 
-  mtx_lock(&device_metrics.mutex);
-  for (size_t i = 0; i < device_metrics.size; i++) {
-    METRIC metric = device_metrics.metrics[i];
-    // LOG(LOG_DEBUG, "%s = %lf\n", metric.name, metric.value);
+  return NULL;
+}
 
-    snprintf(buffer, sizeof(buffer), "# TYPE growatt_%s gauge\ngrowatt_%s %lf\n", metric.name, metric.name, metric.value);
-    strlcat(metrics, buffer, RESPONSE_BUFFER_SIZE);
+static METRIC_GROUP metric_group(char const name[static 1]) {
+  for (size_t i = 0; i < COUNT(input_registers); i++) {
+    if (!strcmp(input_registers[i].metric_name, name)) {
+      return strcmp(input_registers[i].state_class, "total_increasing") ? METRIC_GROUP_FAST : METRIC_GROUP_SLOW;
+    }
   }
-  mtx_unlock(&device_metrics.mutex);
 
-  if (device_metrics.read_metric_succeeded_total == 0) {
-    code = EXIT_FAILURE;
+  return METRIC_GROUP_SLOW;
+}
+
+/**
+ * Append a line to the exposition, returns where it landed (empty once the text is full)
+ */
+__attribute__((format(printf, 1, 2))) static SLICE exposition_append(char const format[static 1], ...) {
+  const size_t room = sizeof(exposition.text) - exposition.length;
+  va_list args;
+  va_start(args, format);
+  const int length = vsnprintf(exposition.text + exposition.length, room, format, args);
+  va_end(args);
+
+  if (length < 0 || (size_t)length >= room) {
+    exposition.text[exposition.length] = '\0';
+    LOG(LOG_ERROR, "Exposition truncated to %zu bytes", exposition.length);
+    return (SLICE){exposition.length, 0};
+  }
+
+  const SLICE slice = {exposition.length, (size_t)length};
+  exposition.length += (size_t)length;
+
+  return slice;
+}
+
+static void exposition_add_sample(const SNAPSHOT *snapshot, const METRIC *sample, const bool labelled) {
+  if (exposition.sample_count == EXPOSITION_MAX_SAMPLES) {
+    return;
+  }
+
+  // no explicit timestamp, which Prometheus would reject as out of order or too old once a value is served again:
+  // samples get the time of the scrape, and the ones which were not read again for too long are left out instead
+  const SLICE line = labelled ? exposition_append(EXPOSED_PREFIX "%s{slave=\"%d\"} %lf\n", sample->name, snapshot->slave_id, sample->value)
+                              : exposition_append(EXPOSED_PREFIX "%s %lf\n", sample->name, sample->value);
+  exposition.samples[exposition.sample_count++] = (SAMPLE){line, snapshot->slave};
+  exposition.families[exposition.family_count - 1].sample_count++;
+  if (sample->expires_at < exposition.expires_at) {
+    exposition.expires_at = sample->expires_at;
+  }
+}
+
+/**
+ * Render the latest snapshot of every unit
+ */
+static void build_exposition(const int64_t now) {
+  // with several units, each sample is labelled with its slave id and grouped with the samples of the same metric
+  // expired samples are left out
+  const size_t count = atomic_load(&slave_count);
+
+  exposition.length = 0;
+  exposition.text[0] = '\0';
+  exposition.family_count = 0;
+  exposition.sample_count = 0;
+  exposition.expires_at = INT64_MAX;
+
+  for (size_t slave = 0; slave < count; slave++) {
+    const SNAPSHOT *snapshot = prometheus_latest[slave];
+
+    for (size_t i = 0; snapshot && i < snapshot->size; i++) {
+      const METRIC *metric = &snapshot->metrics[i];
+
+      if (metric_expired(metric, now) || (count > 1 && find_metric(prometheus_latest, slave, metric->name, now))) {
+        continue; // already written along with a previous unit
+      }
+      if (exposition.family_count == EXPOSITION_MAX_FAMILIES) {
+        LOG(LOG_ERROR, "More than %u metrics, %s left out", EXPOSITION_MAX_FAMILIES, metric->name);
+        continue;
+      }
+
+      FAMILY *family = &exposition.families[exposition.family_count++];
+      snprintf(family->name, sizeof(family->name), EXPOSED_PREFIX "%s", metric->name);
+      family->group = metric_group(metric->name);
+      family->type = exposition_append("# TYPE " EXPOSED_PREFIX "%s gauge\n", metric->name);
+      family->first_sample = exposition.sample_count;
+      family->sample_count = 0;
+
+      if (count == 1) {
+        exposition_add_sample(snapshot, metric, false);
+        continue;
+      }
+
+      for (size_t other = slave; other < count; other++) {
+        const METRIC *sample = find_metric(&prometheus_latest[other], 1, metric->name, now);
+        if (sample) {
+          exposition_add_sample(prometheus_latest[other], sample, true);
+        }
+      }
+    }
+  }
+
+  exposition.built = true;
+}
+
+/**
+ * Take the snapshots queued for the HTTP server, the exposition is built again on the next scrape
+ */
+void prometheus_collect(void) {
+  SNAPSHOT *snapshot = NULL;
+  while ((snapshot = sink_take(&prometheus_sink))) {
+    snapshot_keep(prometheus_latest, snapshot);
+    exposition.built = false;
+  }
+}
+
+/**
+ * Decode the URL-encoded length bytes of source into destination, which is always terminated
+ */
+static void url_decode(char *destination, const size_t size, const char *source, const size_t length) {
+  size_t written = 0;
+  for (size_t i = 0; i < length && written + 1 < size; i++) {
+    char byte = source[i] == '+' ? ' ' : source[i];
+    if (byte == '%' && i + 2 < length && isxdigit((unsigned char)source[i + 1]) && isxdigit((unsigned char)source[i + 2])) {
+      const char hex[] = {source[i + 1], source[i + 2], '\0'};
+      byte = (char)strtol(hex, NULL, 16); // NOLINT(readability-magic-numbers)
+      i += 2;
+    }
+    destination[written++] = byte;
+  }
+  destination[written] = '\0';
+}
+
+/**
+ * Split the next "key=value" parameter off query, decoded, returns false once there is none left
+ */
+static bool query_next(const char **query, char key[static EXPOSED_NAME_SIZE], char value[static REQUEST_BUFFER_SIZE]) {
+  if (**query == '\0') {
+    return false;
+  }
+
+  const size_t length = strcspn(*query, "&");
+  const char *equal = memchr(*query, '=', length);
+  const size_t key_length = equal ? (size_t)(equal - *query) : length;
+  url_decode(key, EXPOSED_NAME_SIZE, *query, key_length);
+  url_decode(value, REQUEST_BUFFER_SIZE, equal ? equal + 1 : *query + length, equal ? length - key_length - 1 : 0);
+
+  *query += length + ((*query)[length] == '&');
+
+  return true;
+}
+
+/**
+ * Split "METHOD /path?query HTTP/1.x" into request
+ */
+static int parse_request(char const raw[static 1], HTTP_REQUEST *request) {
+  char target[REQUEST_BUFFER_SIZE];
+  int major = 0;
+  int minor = 0;
+  // NOLINTNEXTLINE(cert-err34-c)
+  if (sscanf(raw, "%7[A-Z] %1023s HTTP/%d.%d", request->method, target, &major, &minor) != 4 || target[0] != '/' || major != 1) {
+    return EXIT_FAILURE;
+  }
+
+  const size_t path_length = strcspn(target, "?");
+  memcpy(request->path, target, path_length);
+  request->path[path_length] = '\0';
+  strlcpy(request->query, target[path_length] ? target + path_length + 1 : "", sizeof(request->query));
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Turn the path and query of a scrape into a selector, returns the status line of the response on failure
+ */
+static const char *parse_selector(const HTTP_REQUEST *request, SELECTOR *selector) {
+  const char *path = request->path + strlen(PATH_METRICS);
+  int slave_id = 0;
+  int consumed = 0;
+
+  selector->groups = METRIC_GROUP_ALL;
+  selector->slave = SIZE_MAX;
+  selector->name_count = 0;
+  selector->pattern_count = 0;
+
+  if (!strcmp(path, "/fast")) {
+    selector->groups = METRIC_GROUP_FAST;
+  } else if (!strcmp(path, "/slow")) {
+    selector->groups = METRIC_GROUP_SLOW;
+  } else if (sscanf(path, "/device/%d%n", &slave_id, &consumed) == 1 && path[consumed] == '\0') { // NOLINT(cert-err34-c)
+    selector->slave = find_slave(slave_id);
+    if (selector->slave == SIZE_MAX) {
+      return "HTTP/1.1 404 Not Found\r\n";
+    }
+  } else if (path[0] != '\0') {
+    return "HTTP/1.1 404 Not Found\r\n";
+  }
+
+  const char *query = request->query;
+  char key[EXPOSED_NAME_SIZE];
+  char value[REQUEST_BUFFER_SIZE];
+  while (query_next(&query, key, value)) {
+    const bool name = !strcmp(key, "name[]");
+    if (!name && strcmp(key, "match[]")) {
+      continue; // e.g. added by a proxy
+    }
+
+    size_t *count = name ? &selector->name_count : &selector->pattern_count;
+    if (*count == SELECTOR_MAX_NAMES || strlen(value) >= EXPOSED_NAME_SIZE) {
+      return "HTTP/1.1 400 Bad Request\r\n";
+    }
+    strlcpy(name ? selector->names[(*count)++] : selector->patterns[(*count)++], value, EXPOSED_NAME_SIZE);
+  }
+
+  return NULL;
+}
+
+static bool selector_matches(const SELECTOR *selector, const FAMILY *family) {
+  if (!(family->group & selector->groups)) {
+    return false;
+  }
+  if (selector->name_count == 0 && selector->pattern_count == 0) {
+    return true;
+  }
+
+  for (size_t i = 0; i < selector->name_count; i++) {
+    if (!strcmp(selector->names[i], family->name)) {
+      return true;
+    }
+  }
+  for (size_t i = 0; i < selector->pattern_count; i++) {
+    if (!fnmatch(selector->patterns[i], family->name, 0)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/**
+ * Copy the lines of the exposition picked by selector into body, returns their length
+ */
+static size_t select_exposition(const SELECTOR *selector, char body[static sizeof(exposition.text)]) {
+  size_t length = 0;
+  for (size_t i = 0; i < exposition.family_count; i++) {
+    const FAMILY *family = &exposition.families[i];
+    if (!selector_matches(selector, family)) {
+      continue;
+    }
+
+    bool typed = false;
+    for (size_t index = family->first_sample; index < family->first_sample + family->sample_count; index++) {
+      const SAMPLE *sample = &exposition.samples[index];
+      if (selector->slave != SIZE_MAX && sample->slave != selector->slave) {
+        continue;
+      }
+      if (!typed) {
+        memcpy(body + length, exposition.text + family->type.start, family->type.length);
+        length += family->type.length;
+        typed = true;
+      }
+      memcpy(body + length, exposition.text + sample->line.start, sample->line.length);
+      length += sample->line.length;
+    }
+  }
+  body[length] = '\0';
+
+  return length;
+}
+
+/**
+ * Status line and headers of a response without a body
+ */
+static void set_status_response(char *response, char const status_line[static 1]) {
+  strlcpy(response, status_line, RESPONSE_BUFFER_SIZE);
+  strlcat(response, "Server: growatt-exporter\r\nContent-Length: 0\r\n\r\n", RESPONSE_BUFFER_SIZE);
+}
+
+/**
+ * Serve "GET /metrics[/fast|/slow|/device/<slave_id>][?name[]=<name>&match[]=<pattern>...]" from the cached exposition
+ */
+int set_response(char *response, const HTTP_REQUEST *request) {
+  static char selected[sizeof(exposition.text)]; // off the stack, only one request is served at a time
+  SELECTOR selector;
+
+  const char *error = parse_selector(request, &selector);
+  if (error) {
+    set_status_response(response, error);
+    return EXIT_FAILURE;
+  }
+
+  request_fresh_metrics();
+
+  prometheus_collect();
+  const int64_t now = realtime_ms();
+  if (!exposition.built || now >= exposition.expires_at) {
+    build_exposition(now);
+  }
+
+  if (exposition.sample_count == 0) {
     LOG(LOG_ERROR, "No metrics");
-    strlcpy(metrics, "503 Service Temporarily Unavailable\n", RESPONSE_BUFFER_SIZE);
-    strlcpy(response, "HTTP/1.1 503 Service Unavailable\r\n", RESPONSE_BUFFER_SIZE);
-  } else {
-    strlcpy(response, "HTTP/1.1 200 OK\r\n", RESPONSE_BUFFER_SIZE);
+    const char body[] = "503 Service Temporarily Unavailable\n";
+    snprintf(response, RESPONSE_BUFFER_SIZE,
+             "HTTP/1.1 503 Service Unavailable\r\nServer: growatt-exporter\r\nContent-Length: %zu\r\nContent-Type: %s\r\n\r\n%s",
+             strlen(body), PROMETHEUS_CONTENT_TYPE, body);
+    return EXIT_FAILURE;
+  }
+
+  const bool filtered = selector.groups != METRIC_GROUP_ALL || selector.slave != SIZE_MAX || selector.name_count || selector.pattern_count;
+  const char *body = exposition.text;
+  size_t length = exposition.length;
+  if (filtered) {
+    length = select_exposition(&selector, selected);
+    body = selected;
   }
 
-  strlcat(response, "Server: growatt-exporter\r\n", RESPONSE_BUFFER_SIZE);
-  char content_length[RESPONSE_BUFFER_SIZE];
-  sprintf(content_length, "Content-Length: %zu\r\n", strlen(metrics));
-  strlcat(response, content_length, RESPONSE_BUFFER_SIZE);
-  strlcat(response, "Content-Type: ", RESPONSE_BUFFER_SIZE);
-  strlcat(response, PROMETHEUS_CONTENT_TYPE, RESPONSE_BUFFER_SIZE);
-  strlcat(response, "\r\n\r\n", RESPONSE_BUFFER_SIZE);
-  strlcat(response, metrics, RESPONSE_BUFFER_SIZE);
+  const int header = snprintf(response, RESPONSE_HEADER_SIZE,
+                              "HTTP/1.1 200 OK\r\nServer: growatt-exporter\r\nContent-Length: %zu\r\nContent-Type: %s\r\n\r\n", length,
+                              PROMETHEUS_CONTENT_TYPE);
+  memcpy(response + header, body, length + 1);
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Queue the setting write requested by "POST /settings/<metric_name>?value=<value>[&slave=<slave_id>]", the first
+ * unit being the default.
+ * The response only tells whether the command was accepted, its outcome shows in the command_* metrics.
+ */
+int set_setting_response(char *response, const HTTP_REQUEST *request) {
+  const char *name = request->path + strlen(PATH_SETTINGS);
+  const char *status_line = "HTTP/1.1 400 Bad Request\r\n";
+  int slave_id = device_metrics[0].slave_id;
+  bool valid = true;
+  bool has_value = false;
+  double value = 0;
+
+  const char *query = request->query;
+  char key[EXPOSED_NAME_SIZE];
+  char string[REQUEST_BUFFER_SIZE];
+  while (query_next(&query, key, string)) {
+    char *end = NULL;
+    if (!strcmp(key, "value")) {
+      value = strtod(string, &end);
+      has_value = true;
+    } else if (!strcmp(key, "slave")) {
+      slave_id = (int)strtol(string, &end, 10); // NOLINT(readability-magic-numbers)
+    } else {
+      continue;
+    }
+    valid = valid && end != string && *end == '\0';
+  }
+
+  if (valid && has_value) {
+    switch (submit_command(slave_id, name, value)) {
+    case COMMAND_QUEUED:
+      status_line = "HTTP/1.1 202 Accepted\r\n";
+      break;
+    case COMMAND_UNKNOWN:
+      status_line = "HTTP/1.1 404 Not Found\r\n";
+      break;
+    case COMMAND_FULL:
+      status_line = "HTTP/1.1 503 Service Unavailable\r\n";
+      break;
+    default:
+      break;
+    }
+  }
+
+  set_status_response(response, status_line);
+
+  return strncmp(status_line, "HTTP/1.1 202", strlen("HTTP/1.1 202")) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * Send the recorded spans as Chrome trace-event JSON, closing the connection marks the end of the response
+ */
+int send_spans(const int client_fd) {
+  char *json = NULL;
+  size_t size = 0;
+  FILE *stream = open_memstream(&json, &size);
+  if (stream == NULL) {
+    PERROR("open_memstream() failed");
+    close(client_fd);
+    return EXIT_FAILURE;
+  }
+
+  fputs("HTTP/1.1 200 OK\r\nServer: growatt-exporter\r\nContent-Type: application/json\r\nConnection: close\r\n\r\n", stream);
+  const size_t count = span_dump(stream);
+  fclose(stream);
+
+  int code = EXIT_SUCCESS;
+  for (size_t sent = 0; sent < size;) {
+    const ssize_t written = send(client_fd, json + sent, size - sent, MSG_NOSIGNAL);
+    if (written < 0) {
+      PERROR("Sending spans failed");
+      code = EXIT_FAILURE;
+      break;
+    }
+    sent += (size_t)written;
+  }
+  free(json);
+  close(client_fd);
+
+  LOG(LOG_INFO, "HTTP server sent %zu spans (%zu bytes)", count, size);
 
   return code;
 }
 
-int handle_client(const int client_fd) {
+int handle_client(const int client_fd, const prometheus_config *config) {
   LOG(LOG_DEBUG, "HTTP server received request...");
 
   int code = EXIT_SUCCESS;
-  char request[REQUEST_BUFFER_SIZE * sizeof(char)];
-  char response[RESPONSE_BUFFER_SIZE] = {'\0'};
+  char raw[REQUEST_BUFFER_SIZE * sizeof(char)] = {'\0'};
+  static HTTP_REQUEST request; // off the stack, only one request is served at a time
+  static char response[RESPONSE_BUFFER_SIZE];
+  response[0] = '\0';
 
-  ssize_t const bytes_received = recv(client_fd, request, REQUEST_BUFFER_SIZE, 0);
+  ssize_t const bytes_received = recv(client_fd, raw, REQUEST_BUFFER_SIZE - 1, 0); // keep the request terminated
   if (bytes_received < MINIMUM_REQUEST_SIZE) {
     PERROR("Request too short (only %zu bytes)\n", bytes_received);
-    strlcpy(response, "HTTP/1.1 400 Bad Request\r\n", RESPONSE_BUFFER_SIZE);
+    close(client_fd);
     return EXIT_FAILURE;
   }
 
-  if (!strncmp(request, REQUEST_PROMETHEUS, strlen(REQUEST_PROMETHEUS))) {
-    code = set_response(response);
+  memset(&request, 0, sizeof(request)); // nothing of the previous request must survive a parse failure
+  const bool parsed = !parse_request(raw, &request);
+  const bool get = parsed && !strcmp(request.method, "GET");
+  const bool post = parsed && !strcmp(request.method, "POST");
+  const size_t metrics_length = strlen(PATH_METRICS);
+
+  if (get && !strncmp(request.path, PATH_METRICS, metrics_length) &&
+      (request.path[metrics_length] == '\0' || request.path[metrics_length] == '/')) {
+    const uint64_t span = span_begin();
+    code = set_response(response, &request);
+    span_end(span, "set_response", NULL, 0);
+  } else if (get && !strcmp(request.path, PATH_TRACE) && spans_recorded()) {
+    return send_spans(client_fd);
+  } else if (post && !strncmp(request.path, PATH_SETTINGS, strlen(PATH_SETTINGS)) && !config->allow_commands) {
+    LOG(LOG_ERROR, "Refusing to write %s, see prometheus.allow_commands", request.path + strlen(PATH_SETTINGS));
+    set_status_response(response, "HTTP/1.1 403 Forbidden\r\n");
+    code = EXIT_FAILURE;
+  } else if (post && !strncmp(request.path, PATH_SETTINGS, strlen(PATH_SETTINGS))) {
+    code = set_setting_response(response, &request);
   } else {
-    strlcpy(response, "HTTP/1.1 400 Bad Request\r\n", RESPONSE_BUFFER_SIZE);
+    set_status_response(response, get || post ? "HTTP/1.1 404 Not Found\r\n" : "HTTP/1.1 400 Bad Request\r\n");
+    code = EXIT_FAILURE;
   }
 
   size_t const expected_size = strlen(response);
@@ -110,37 +623,129 @@ static void sig_handler() {
   stop_prometheus_thread();
 }
 
-int start_prometheus_thread(void *config_ptr) {
-  signal(SIGINT, sig_handler);
-  signal(SIGTERM, sig_handler);
+int init_prometheus(const prometheus_config *config) {
+  prometheus_wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (prometheus_wakeup < 0) {
+    PERROR("eventfd() failed");
+    return EXIT_FAILURE;
+  }
+
+  if (config->port && sink_open(&prometheus_sink, "prometheus", config->queue_policy, config->queue_depth)) {
+    return EXIT_FAILURE;
+  }
 
-  prometheus_config *config = (prometheus_config *)config_ptr;
+  return reload_init(&prometheus_reload, &prometheus_pending, sizeof(prometheus_pending));
+}
 
-  server_socket = socket(AF_INET6,    // IPv6
-                         SOCK_STREAM, // TCP
-                         0            // protocol 0
+/**
+ * Bind the HTTP server socket and start listening, server_socket is left untouched on failure
+ */
+int listen_prometheus(const prometheus_config *config) {
+  const int fd = socket(AF_INET6,    // IPv6
+                        SOCK_STREAM, // TCP
+                        0            // protocol 0
   );
 
   const struct sockaddr_in6 address = {.sin6_family = AF_INET6, .sin6_port = htons(config->port), .sin6_addr = in6addr_any};
 
   // prevent "bind failed: Address already in use" when restarting the program too quickly
-  if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int))) {
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int))) {
     PERROR("setsockopt(SO_REUSEADDR) failed");
   }
 
-  if (bind(server_socket, (struct sockaddr *)&address, sizeof(address))) {
+  if (bind(fd, (struct sockaddr *)&address, sizeof(address))) {
     PERROR("bind failed");
+    close(fd);
     return EXIT_FAILURE;
   }
 
-  if (listen(server_socket, BACKLOG) < 0) {
+  if (listen(fd, BACKLOG) < 0) {
     PERROR("The server is not listening");
+    close(fd);
     return EXIT_FAILURE;
   }
 
+  server_socket = fd;
   LOG(LOG_INFO, "HTTP server listening on [::]:%" PRIu16 "...", config->port);
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Hand a new configuration over to the thread owning the HTTP server
+ */
+void reload_prometheus(const prometheus_config *config) {
+  reload_offer(&prometheus_reload, config);
+
+  if (write(prometheus_wakeup, &(uint64_t){1}, sizeof(uint64_t)) < 0) {
+    PERROR("Could not wake up HTTP server");
+  }
+}
+
+/**
+ * Switch to a new configuration, the current socket keeps listening if the new port cannot be bound
+ */
+int apply_prometheus_config(prometheus_config *config, const prometheus_config *next) {
+  if (config->port != next->port) {
+    const int previous_socket = server_socket;
+    if (listen_prometheus(next)) {
+      LOG(LOG_ERROR, "Cannot listen on port %d, keeping port %d", next->port, config->port);
+      reload_reject(&prometheus_reload);
+      return EXIT_FAILURE;
+    }
+    close(previous_socket);
+  }
+
+  sink_configure(&prometheus_sink, next->queue_policy, next->queue_depth);
+  *config = *next;
+  LOG(LOG_INFO, "HTTP server configuration reloaded");
+
+  return EXIT_SUCCESS;
+}
+
+int start_prometheus_thread(void *config_ptr) {
+  span_thread("PRMT");
+  signal(SIGINT, sig_handler);
+  signal(SIGTERM, sig_handler);
+
+  prometheus_config config = *(const prometheus_config *)config_ptr;
+  prometheus_config next;
+
+  if (listen_prometheus(&config)) {
+    return EXIT_FAILURE;
+  }
+
   while (keep_running) {
     LOG(LOG_DEBUG, "HTTP server waiting for request...");
+
+    struct pollfd fds[] = {{.fd = server_socket, .events = POLLIN},
+                           {.fd = prometheus_wakeup, .events = POLLIN},
+                           {.fd = prometheus_sink.wakeup, .events = POLLIN}};
+    if (poll(fds, COUNT(fds), -1) < 0 && errno != EINTR) {
+      PERROR("poll() failed");
+      return EXIT_FAILURE;
+    }
+
+    if (fds[2].revents & POLLIN) {
+      sink_wait(&prometheus_sink, 0);
+      prometheus_collect(); // rather than let snapshots pile up in between two scrapes
+    }
+
+    if (fds[1].revents & POLLIN) {
+      uint64_t wakeups = 0;
+      if (read(prometheus_wakeup, &wakeups, sizeof(wakeups)) < 0) {
+        PERROR("read() failed");
+      }
+      if (reload_take(&prometheus_reload, &next)) {
+        apply_prometheus_config(&config, &next);
+      }
+      continue;
+    }
+
+    if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+      continue;
+    }
+
     const int client_fd = accept(server_socket, NULL, NULL); // NOLINT(android-cloexec-accept)
     if (client_fd < 0) {
       if (keep_running) {
@@ -150,8 +755,10 @@ int start_prometheus_thread(void *config_ptr) {
       return EXIT_SUCCESS;
     }
 
-    handle_client(client_fd);
+    handle_client(client_fd, &config);
   }
 
   return EXIT_SUCCESS;
 }
+
+#endif /* GROWATT_PROMETHEUS_H */
@@ -0,0 +1,81 @@
+#ifndef GROWATT_RELOAD_H
+#define GROWATT_RELOAD_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+
+#include "growatt.h"
+
+enum {
+  CONFIG_STRING_SIZE = 256U,
+};
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static volatile sig_atomic_t reload_requested = 0;
+
+/** Called by the event loop upon SIGHUP to parse the configuration file again */
+typedef int (*reload_callback)(void *context);
+
+/**
+ * Hand-over of a new configuration section from the thread reloading the configuration file to the thread owning
+ * the subsystem, which picks it up at its next safe point.
+ * Must be initialized with reload_init().
+ */
+typedef struct {
+  mtx_t mutex;
+  atomic_uint generation;
+  /** Generation last taken by the owning thread */
+  unsigned taken;
+  size_t size;
+  void *pending;
+  /** The owning thread kept its current section, see reload_reject() */
+  atomic_bool rejected;
+} RELOAD;
+
+int reload_init(RELOAD *reload, void *pending, const size_t size) {
+  reload->generation = 0;
+  reload->taken = 0;
+  reload->size = size;
+  reload->pending = pending;
+  reload->rejected = false;
+  return mtx_init(&reload->mutex, mtx_plain) == thrd_success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void reload_offer(RELOAD *reload, const void *section) {
+  mtx_lock(&reload->mutex);
+  memcpy(reload->pending, section, reload->size);
+  atomic_fetch_add(&reload->generation, 1);
+  mtx_unlock(&reload->mutex);
+}
+
+/**
+ * Copy the pending section into dest if a new one was offered since the last call
+ */
+bool reload_take(RELOAD *reload, void *dest) {
+  if (atomic_load(&reload->generation) == reload->taken) {
+    return false;
+  }
+
+  mtx_lock(&reload->mutex);
+  memcpy(dest, reload->pending, reload->size);
+  reload->taken = atomic_load(&reload->generation);
+  mtx_unlock(&reload->mutex);
+
+  return true;
+}
+
+/**
+ * Called by the owning thread when it could not switch to the section taken and kept its current one, so that the
+ * next reload offers it again even if the file did not change
+ */
+void reload_reject(RELOAD *reload) { atomic_store(&reload->rejected, true); }
+
+/**
+ * Whether the last section taken was rejected, to be offered again
+ */
+bool reload_rejected(RELOAD *reload) { return atomic_exchange(&reload->rejected, false); }
+
+#endif /* GROWATT_RELOAD_H */
@@ -0,0 +1,171 @@
+#ifndef GROWATT_SCAN_H
+#define GROWATT_SCAN_H
+
+#include <errno.h>
+#include <modbus.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h> // sleep()
+
+#include "capability.h"
+#include "log.h"
+#include "modbus.h"
+
+#undef LOG_TAG
+#define LOG_TAG "94m[SCAN] "
+
+enum {
+  SCAN_ATTEMPTS = 2U, // per request when the device does not answer at all
+  SCAN_SAMPLES = 3U,  // sweeps telling live registers from constant ones
+  SCAN_INTERVAL = 2,  // seconds between two sweeps
+};
+
+/**
+ * Read a range of addresses, bisecting it whenever the device answers with an exception so that the supported
+ * ranges are found with few requests (a single one when the whole range is supported).
+ */
+static void scan_range(modbus_t *ctx, CAPABILITY_MAP *map, const REGISTER_TYPE type, const int start, const int length) {
+  uint16_t buffer[MODBUS_MAX_READ_REGISTERS] = {0};
+  int ret = -1;
+
+  for (size_t attempt = 0; attempt < SCAN_ATTEMPTS && -1 == ret; attempt++) {
+    current_slave->timeouts = 0; // no unit is considered dead while scanning
+    ret = read_block(ctx, type, start, length, buffer);
+    if (-1 == ret && modbus_exception(errno)) {
+      break;
+    }
+  }
+
+  if (-1 != ret) {
+    for (int i = 0; i < length; i++) {
+      map->states[start + i] = ADDRESS_CONSTANT;
+      map->values[start + i] = buffer[i];
+    }
+    return;
+  }
+
+  if (!modbus_exception(errno)) {
+    LOG(LOG_ERROR, "No answer for addresses %d to %d: %s", start, start + length - 1, modbus_strerror(errno));
+    return; // left unknown, bisecting silence would only pile timeouts up
+  }
+
+  if (length == 1) {
+    map->states[start] = ADDRESS_UNSUPPORTED;
+    return;
+  }
+
+  scan_range(ctx, map, type, start, length / 2);
+  scan_range(ctx, map, type, start + length / 2, length - length / 2);
+}
+
+/**
+ * Read supported ranges again, registers whose value changed are live
+ */
+static void sample_map(modbus_t *ctx, CAPABILITY_MAP *map, const REGISTER_TYPE type) {
+  int start = 0;
+  while (start < (int)CAPABILITY_ADDRESS_SPACE) {
+    if (map->states[start] != ADDRESS_LIVE && map->states[start] != ADDRESS_CONSTANT) {
+      start++;
+      continue;
+    }
+
+    int length = 1;
+    while (start + length < (int)CAPABILITY_ADDRESS_SPACE && length < MODBUS_MAX_READ_REGISTERS &&
+           (map->states[start + length] == ADDRESS_LIVE || map->states[start + length] == ADDRESS_CONSTANT)) {
+      length++;
+    }
+
+    uint16_t buffer[MODBUS_MAX_READ_REGISTERS] = {0};
+    current_slave->timeouts = 0;
+    if (-1 != read_block(ctx, type, start, length, buffer)) {
+      for (int i = 0; i < length; i++) {
+        if (buffer[i] != map->values[start + i]) {
+          map->states[start + i] = ADDRESS_LIVE;
+          map->values[start + i] = buffer[i];
+        }
+      }
+    }
+
+    start += length;
+  }
+}
+
+static void log_map(const int slave_id, char const type[static 1], const CAPABILITY_MAP *map) {
+  size_t counts[COUNT(address_states)] = {0};
+  for (size_t i = 0; i < CAPABILITY_ADDRESS_SPACE; i++) {
+    counts[map->states[i]]++;
+  }
+
+  LOG(LOG_INFO, "Slave %d %s registers: %zu live, %zu constant, %zu unsupported, %zu unknown", slave_id, type,
+      counts[ADDRESS_LIVE], counts[ADDRESS_CONSTANT], counts[ADDRESS_UNSUPPORTED], counts[ADDRESS_UNKNOWN]);
+}
+
+/**
+ * Discover the registers of every unit and write the capability cache, or print it when none is configured
+ */
+int scan_modbus(const modbus_config *config) {
+  int code = connect_modbus(config);
+  if (code != EXIT_SUCCESS) {
+    return code;
+  }
+
+  const size_t count = atomic_load(&slave_count);
+  const double started_at = monotonic_ms();
+
+  for (size_t slave = 0; slave < count; slave++) {
+    if (select_slave(ctx, slave)) {
+      disconnect_modbus();
+      return query_device_failed(NULL, "Set slave failed");
+    }
+
+    CAPABILITY *capability = &current_slave->capability;
+    memset(capability, 0, sizeof(*capability));
+    LOG(LOG_INFO, "Scanning slave %d on %s...", current_slave->slave_id, config->device_or_uri);
+
+    for (int start = 0; start < (int)CAPABILITY_ADDRESS_SPACE; start += MODBUS_MAX_READ_REGISTERS) {
+      const int length = (int)CAPABILITY_ADDRESS_SPACE - start < MODBUS_MAX_READ_REGISTERS ? (int)CAPABILITY_ADDRESS_SPACE - start
+                                                                                             : MODBUS_MAX_READ_REGISTERS;
+      scan_range(ctx, &capability->holding, REGISTER_HOLDING, start, length);
+      scan_range(ctx, &capability->input, REGISTER_INPUT, start, length);
+    }
+
+    for (size_t sample = 1; sample < SCAN_SAMPLES; sample++) {
+      sleep(SCAN_INTERVAL); // NOLINT(concurrency-mt-unsafe)
+      sample_map(ctx, &capability->holding, REGISTER_HOLDING);
+      sample_map(ctx, &capability->input, REGISTER_INPUT);
+    }
+
+    capability->known = true;
+    log_map(current_slave->slave_id, "holding", &capability->holding);
+    log_map(current_slave->slave_id, "input", &capability->input);
+  }
+
+  disconnect_modbus();
+  LOG(LOG_INFO, "Scanned %zu slaves in %.1fs", count, (monotonic_ms() - started_at) / 1e3); // NOLINT(readability-magic-numbers)
+
+  FILE *file = config->capability_cache[0] ? fopen(config->capability_cache, "we") : stdout;
+  if (file == NULL) {
+    PERROR("Cannot write capability cache %s", config->capability_cache);
+    return EXIT_FAILURE;
+  }
+
+  fprintf(file, "# growatt_exporter capability cache, written by --scan\n");
+  fprintf(file, "# <slave_id> <holding|input> <first address> <last address> <state> [<value>]\n");
+  fprintf(file, "device %s\n", config->device_or_uri);
+  for (size_t slave = 0; slave < count; slave++) {
+    capability_write(file, device_metrics[slave].slave_id, &device_metrics[slave].capability);
+  }
+
+  if (file != stdout && fclose(file)) {
+    PERROR("Cannot write capability cache %s", config->capability_cache);
+    return EXIT_FAILURE;
+  }
+
+  if (file != stdout) {
+    LOG(LOG_INFO, "Capability cache written to %s", config->capability_cache);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+#endif /* GROWATT_SCAN_H */
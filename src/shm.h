@@ -0,0 +1,183 @@
+#ifndef GROWATT_SHM_H
+#define GROWATT_SHM_H
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "growatt-shm.h"
+#include "growatt.h"
+#include "log.h"
+#include "modbus.h"
+#include "sink.h"
+
+#undef LOG_TAG
+#define LOG_TAG "37m[SHMW] "
+
+enum {
+  SHM_SLOT_COUNT = COUNT(holding_registers) + COUNT(input_registers),
+  SHM_UNIT_SIZE = sizeof(GROWATT_SHM_UNIT) + SHM_SLOT_COUNT * sizeof(GROWATT_SHM_SLOT),
+  SHM_NAMES_OFFSET = sizeof(GROWATT_SHM_HEADER),
+  SHM_UNITS_OFFSET = SHM_NAMES_OFFSET + SHM_SLOT_COUNT * GROWATT_SHM_NAME_SIZE,
+  SHM_SIZE = SHM_UNITS_OFFSET + MODBUS_MAX_SLAVES * SHM_UNIT_SIZE,
+  SHM_WAIT = 1000, // ms in between two checks for exits
+};
+
+static_assert((int)GROWATT_SHM_NAME_SIZE == (int)MAX_METRIC_LENGTH, "metric names must fit in the segment");
+static_assert(SHM_UNITS_OFFSET % sizeof(int64_t) == 0 && SHM_UNIT_SIZE % sizeof(int64_t) == 0, "units must be aligned");
+
+// NOLINTBEGIN(cppcoreguidelines-avoid-non-const-global-variables)
+static GROWATT_SHM_HEADER *shm_segment; // NULL unless shm_name is set
+static SINK shm_sink = {.wakeup = -1};
+// NOLINTEND(cppcoreguidelines-avoid-non-const-global-variables)
+
+static const REGISTER *shm_register(const size_t slot) {
+  return slot < COUNT(holding_registers) ? &holding_registers[slot] : &input_registers[slot - COUNT(holding_registers)];
+}
+
+static GROWATT_SHM_UNIT *shm_unit(const size_t slave) {
+  return (GROWATT_SHM_UNIT *)((char *)shm_segment + SHM_UNITS_OFFSET + slave * SHM_UNIT_SIZE);
+}
+
+/**
+ * Slot of the register metric name is read from, -1 for the metrics of the exporter itself
+ */
+static int shm_slot(char const name[static 1], const size_t hint) {
+  if (hint < SHM_SLOT_COUNT && !strcmp(shm_register(hint)->metric_name, name)) {
+    return (int)hint; // metrics mostly come in the order of the register table
+  }
+
+  for (size_t slot = 0; slot < SHM_SLOT_COUNT; slot++) {
+    if (!strcmp(shm_register(slot)->metric_name, name)) {
+      return (int)slot;
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * Publish the values of the register table into the POSIX shared-memory segment name (e.g. "/growatt-exporter"),
+ * does nothing unless name is set. The segment is left in place on exit, with its last values, and reused on restart.
+ */
+int init_shm(char const name[static 1]) {
+  if (name[0] == '\0') {
+    return EXIT_SUCCESS;
+  }
+
+  const int fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644); // NOLINT(readability-magic-numbers)
+  if (fd < 0) {
+    PERROR("Cannot open shared memory %s", name);
+    return EXIT_FAILURE;
+  }
+  if (ftruncate(fd, SHM_SIZE)) {
+    PERROR("Cannot size shared memory %s", name);
+    close(fd);
+    return EXIT_FAILURE;
+  }
+
+  void *address = mmap(NULL, SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (address == MAP_FAILED) {
+    PERROR("Cannot map shared memory %s", name);
+    return EXIT_FAILURE;
+  }
+
+  // readers opening the segment from now on wait for the magic, the ones still mapping it see units being updated
+  shm_segment = address;
+  atomic_store_explicit(&shm_segment->magic, 0, memory_order_relaxed);
+  shm_segment->version = GROWATT_SHM_VERSION;
+  shm_segment->slot_count = SHM_SLOT_COUNT;
+  shm_segment->unit_count = MODBUS_MAX_SLAVES;
+  shm_segment->names_offset = SHM_NAMES_OFFSET;
+  shm_segment->units_offset = SHM_UNITS_OFFSET;
+  shm_segment->unit_size = SHM_UNIT_SIZE;
+  shm_segment->size = SHM_SIZE;
+
+  char *names = (char *)shm_segment + SHM_NAMES_OFFSET;
+  for (size_t slot = 0; slot < SHM_SLOT_COUNT; slot++) {
+    strlcpy(names + slot * GROWATT_SHM_NAME_SIZE, shm_register(slot)->metric_name, GROWATT_SHM_NAME_SIZE);
+  }
+
+  for (size_t slave = 0; slave < MODBUS_MAX_SLAVES; slave++) {
+    GROWATT_SHM_UNIT *unit = shm_unit(slave);
+    const uint32_t sequence = atomic_load_explicit(&unit->sequence, memory_order_relaxed) | 1U;
+    atomic_store_explicit(&unit->sequence, sequence, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memset((char *)unit + sizeof(unit->sequence), 0, SHM_UNIT_SIZE - sizeof(unit->sequence));
+    atomic_store_explicit(&unit->sequence, sequence + 1, memory_order_release);
+  }
+
+  atomic_store_explicit(&shm_segment->magic, GROWATT_SHM_MAGIC, memory_order_release);
+
+  // only the latest values of each unit matter
+  if (sink_open(&shm_sink, "shm", SINK_COALESCE, 1)) {
+    return EXIT_FAILURE;
+  }
+
+  LOG(LOG_INFO, "Publishing metrics to shared memory %s (%d bytes)", name, SHM_SIZE);
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Write snapshot into its unit, under the seqlock of the unit
+ */
+static void shm_write(const SNAPSHOT *snapshot) {
+  GROWATT_SHM_UNIT *unit = shm_unit(snapshot->slave);
+  GROWATT_SHM_SLOT slots[SHM_SLOT_COUNT] = {0};
+  const int64_t now = realtime_ms();
+
+  const uint64_t span = span_begin();
+  for (size_t i = 0, hint = 0; i < snapshot->size; i++) {
+    const METRIC *metric = &snapshot->metrics[i];
+    const int slot = shm_slot(metric->name, hint);
+    if (slot >= 0 && !metric_expired(metric, now)) {
+      slots[slot] = (GROWATT_SHM_SLOT){metric->value, metric->at};
+      hint = (size_t)slot + 1;
+    }
+  }
+
+  // laid out beforehand so that readers retry for as short as possible
+  const uint32_t sequence = atomic_load_explicit(&unit->sequence, memory_order_relaxed);
+  atomic_store_explicit(&unit->sequence, sequence + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  unit->slave_id = snapshot->slave_id;
+  unit->updated_at = now;
+  memcpy(unit + 1, slots, sizeof(slots));
+  atomic_store_explicit(&unit->sequence, sequence + 2, memory_order_release);
+  span_end(span, "shm_write", "slave", snapshot->slave_id);
+}
+
+/**
+ * Write the snapshots queued into the segment. Called by the thread owning it.
+ */
+void shm_collect(void) {
+  SNAPSHOT *snapshot = NULL;
+  while ((snapshot = sink_take(&shm_sink))) {
+    shm_write(snapshot);
+    snapshot_release(snapshot);
+  }
+}
+
+int start_shm_thread(void *arg) { // NOLINT(misc-unused-parameters)
+  span_thread("SHMW");
+  block_signals(NULL); // left to the threads handling them
+
+  while (keep_running) {
+    sink_wait(&shm_sink, SHM_WAIT); // the timeout lets exits through
+    shm_collect();
+  }
+
+  LOG(LOG_INFO, "Shared memory thread exiting");
+
+  return EXIT_SUCCESS;
+}
+
+#endif /* GROWATT_SHM_H */
@@ -0,0 +1,292 @@
+#ifndef GROWATT_SINK_H
+#define GROWATT_SINK_H
+
+#include <errno.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <threads.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "modbus.h"
+
+#undef LOG_TAG
+#define LOG_TAG "97m[SINK] "
+
+enum {
+  SINK_QUEUE_SIZE = 64U,           // snapshots a queue can hold, whatever its depth
+  SINK_QUEUE_DEPTH = 16U,          // default depth
+  SINK_MAX = 4U,                   // sinks fed by the Modbus thread
+  SINK_BLOCK_PERIOD = 1000 * 1000, // ns the Modbus thread sleeps in between two checks of a full queue
+  SINK_BLOCK_TIMEOUT = 10000,      // ms the Modbus thread waits for room at most, in case the sink is gone
+};
+
+/**
+ * What the Modbus thread does when a sink falls behind
+ */
+typedef enum {
+  SINK_DROP_OLDEST, // drop the oldest snapshot queued to make room
+  SINK_COALESCE,    // keep only the latest snapshot of each unit
+  SINK_BLOCK,       // wait for room, up to SINK_BLOCK_TIMEOUT
+} SINK_POLICY;
+
+/**
+ * Published metrics of one unit at some point, never modified once queued.
+ * Shared by the sinks, the last one done with it frees it.
+ */
+typedef struct {
+  atomic_uint references;
+  /** Index of the unit in device_metrics */
+  size_t slave;
+  int slave_id;
+  size_t size;
+  METRIC metrics[];
+} SNAPSHOT;
+
+/**
+ * Snapshots on their way from the Modbus thread (the only producer) to the thread of one sink (the only consumer)
+ */
+typedef struct {
+  char const *name;
+  atomic_int policy;
+  atomic_size_t depth;
+  /** Written at head by the producer; tail is moved by the consumer taking a snapshot or by the producer dropping it */
+  SNAPSHOT *_Atomic ring[SINK_QUEUE_SIZE];
+  atomic_size_t head;
+  atomic_size_t tail;
+  /** Latest snapshot of each unit, under SINK_COALESCE */
+  SNAPSHOT *_Atomic latest[MODBUS_MAX_SLAVES];
+  /** eventfd readable once something was queued */
+  int wakeup;
+  atomic_size_t dropped_total;
+} SINK;
+
+// NOLINTBEGIN(cppcoreguidelines-avoid-non-const-global-variables)
+static SINK *sinks[SINK_MAX]; // opened before the Modbus thread starts
+static size_t sink_count;
+static atomic_bool sink_inline; // consumers run on the Modbus thread (event loop), which must not wait for them
+// NOLINTEND(cppcoreguidelines-avoid-non-const-global-variables)
+
+/**
+ * Parse "drop_oldest", "coalesce" or "block"
+ */
+int sink_parse_policy(char const name[static 1], SINK_POLICY *policy) {
+  static const char *const names[] = {[SINK_DROP_OLDEST] = "drop_oldest", [SINK_COALESCE] = "coalesce", [SINK_BLOCK] = "block"};
+  for (size_t i = 0; i < COUNT(names); i++) {
+    if (!strcmp(names[i], name)) {
+      *policy = (SINK_POLICY)i;
+      return EXIT_SUCCESS;
+    }
+  }
+
+  return EXIT_FAILURE;
+}
+
+void snapshot_release(SNAPSHOT *snapshot) {
+  if (snapshot && atomic_fetch_sub_explicit(&snapshot->references, 1, memory_order_acq_rel) == 1) {
+    free(snapshot);
+  }
+}
+
+/**
+ * Whether metric (at index in its snapshot) was read after the previous snapshot of the same unit
+ */
+bool snapshot_fresh(const SNAPSHOT *previous, const METRIC *metric, const size_t index) {
+  if (previous == NULL) {
+    return true;
+  }
+  if (index < previous->size && !strcmp(previous->metrics[index].name, metric->name)) {
+    return previous->metrics[index].at != metric->at; // metrics mostly stay in place
+  }
+
+  for (size_t i = 0; i < previous->size; i++) {
+    if (!strcmp(previous->metrics[i].name, metric->name)) {
+      return previous->metrics[i].at != metric->at;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * Replace the snapshot kept for its unit in latest with snapshot, whose reference is handed over
+ */
+void snapshot_keep(SNAPSHOT *latest[static MODBUS_MAX_SLAVES], SNAPSHOT *snapshot) {
+  snapshot_release(latest[snapshot->slave]);
+  latest[snapshot->slave] = snapshot;
+}
+
+void sink_configure(SINK *sink, const SINK_POLICY policy, const int depth) {
+  atomic_store(&sink->policy, policy);
+  atomic_store(&sink->depth, depth < 1 ? 1 : depth > (int)SINK_QUEUE_SIZE ? SINK_QUEUE_SIZE : (size_t)depth);
+}
+
+size_t sink_depth(SINK *sink) {
+  size_t depth = atomic_load(&sink->head) - atomic_load(&sink->tail);
+  for (size_t slave = 0; slave < MODBUS_MAX_SLAVES; slave++) {
+    depth += atomic_load(&sink->latest[slave]) != NULL;
+  }
+  return depth;
+}
+
+static void sink_drop(SINK *sink, SNAPSHOT *snapshot) {
+  snapshot_release(snapshot);
+  const size_t dropped = atomic_fetch_add_explicit(&sink->dropped_total, 1, memory_order_relaxed) + 1;
+  LOG(LOG_DEBUG, "Sink %s fell behind, dropped %zu snapshots so far", sink->name, dropped);
+}
+
+/**
+ * Remove the oldest snapshot of the ring, unless the consumer just took it
+ */
+static void sink_drop_oldest(SINK *sink) {
+  size_t tail = atomic_load_explicit(&sink->tail, memory_order_acquire);
+  SNAPSHOT *oldest = atomic_load_explicit(&sink->ring[tail % SINK_QUEUE_SIZE], memory_order_relaxed);
+  if (atomic_compare_exchange_strong(&sink->tail, &tail, tail + 1)) {
+    sink_drop(sink, oldest);
+  }
+}
+
+/**
+ * Queue snapshot, whose reference is handed over, according to the policy of the sink. Called by the producer only.
+ */
+static void sink_push(SINK *sink, SNAPSHOT *snapshot) {
+  const SINK_POLICY policy = atomic_load_explicit(&sink->policy, memory_order_relaxed);
+
+  if (policy == SINK_COALESCE) {
+    SNAPSHOT *previous = atomic_exchange(&sink->latest[snapshot->slave], snapshot);
+    if (previous) {
+      sink_drop(sink, previous);
+    }
+  } else {
+    const size_t head = atomic_load_explicit(&sink->head, memory_order_relaxed);
+    const struct timespec period = {.tv_sec = 0, .tv_nsec = SINK_BLOCK_PERIOD};
+    for (int waited = 0; head - atomic_load_explicit(&sink->tail, memory_order_acquire) >= atomic_load(&sink->depth);) {
+      if (policy == SINK_BLOCK && waited++ < SINK_BLOCK_TIMEOUT && keep_running && !atomic_load(&sink_inline)) {
+        thrd_sleep(&period, NULL);
+      } else {
+        sink_drop_oldest(sink);
+      }
+    }
+
+    atomic_store_explicit(&sink->ring[head % SINK_QUEUE_SIZE], snapshot, memory_order_relaxed);
+    atomic_store_explicit(&sink->head, head + 1, memory_order_release);
+  }
+
+  if (write(sink->wakeup, &(uint64_t){1}, sizeof(uint64_t)) < 0) {
+    PERROR("Could not wake up sink %s", sink->name);
+  }
+}
+
+/**
+ * Next snapshot queued, oldest first, or NULL. The caller owns the reference returned. Called by the consumer only.
+ */
+SNAPSHOT *sink_take(SINK *sink) {
+  size_t tail = atomic_load_explicit(&sink->tail, memory_order_acquire);
+  while (tail != atomic_load_explicit(&sink->head, memory_order_acquire)) {
+    SNAPSHOT *snapshot = atomic_load_explicit(&sink->ring[tail % SINK_QUEUE_SIZE], memory_order_relaxed);
+    if (atomic_compare_exchange_weak(&sink->tail, &tail, tail + 1)) {
+      return snapshot; // not dropped by the producer meanwhile
+    }
+  }
+
+  for (size_t slave = 0; slave < MODBUS_MAX_SLAVES; slave++) {
+    SNAPSHOT *snapshot = atomic_exchange(&sink->latest[slave], NULL);
+    if (snapshot) {
+      return snapshot;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Wait up to timeout ms for something to be queued, returns false on timeout
+ */
+bool sink_wait(SINK *sink, const int timeout) {
+  struct pollfd fd = {.fd = sink->wakeup, .events = POLLIN};
+  if (poll(&fd, 1, timeout) <= 0) {
+    return false;
+  }
+
+  uint64_t wakeups = 0;
+  if (read(sink->wakeup, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN) {
+    PERROR("read() failed");
+  }
+  return true;
+}
+
+/**
+ * Copy the published metrics of the unit at index slave and queue them to every sink
+ */
+static void sink_publish(const size_t slave) {
+  METRICS *store = &device_metrics[slave];
+
+  mtx_lock(&store->mutex);
+  SNAPSHOT *snapshot = malloc(sizeof(SNAPSHOT) + store->size * sizeof(METRIC));
+  if (snapshot == NULL) {
+    PERROR("malloc failed");
+    exit(errno);
+  }
+  memcpy(snapshot->metrics, store->metrics, store->size * sizeof(METRIC));
+  snapshot->size = store->size;
+  mtx_unlock(&store->mutex);
+
+  snapshot->slave = slave;
+  snapshot->slave_id = store->slave_id;
+  atomic_init(&snapshot->references, (unsigned)sink_count);
+
+  for (size_t i = 0; i < sink_count; i++) {
+    sink_push(sinks[i], snapshot);
+  }
+}
+
+/**
+ * Queue depth and drops of each sink, as metrics of the unit being queried
+ */
+static void sink_push_metrics(void) {
+  char name[MAX_METRIC_LENGTH];
+  for (size_t i = 0; i < sink_count; i++) {
+    snprintf(name, sizeof(name), "sink_%s_queue_depth", sinks[i]->name);
+    push_metric(name, (double)sink_depth(sinks[i]));
+    snprintf(name, sizeof(name), "sink_%s_dropped_total", sinks[i]->name);
+    push_metric(name, (double)atomic_load(&sinks[i]->dropped_total));
+  }
+}
+
+/**
+ * Start feeding sink with snapshots of the published metrics, before the Modbus thread starts
+ */
+int sink_open(SINK *sink, char const name[static 1], const SINK_POLICY policy, const int depth) {
+  if (sink_count == SINK_MAX) {
+    LOG(LOG_ERROR, "Too many sinks, cannot open %s", name);
+    return EXIT_FAILURE;
+  }
+
+  sink->wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (sink->wakeup < 0) {
+    PERROR("eventfd() failed");
+    return EXIT_FAILURE;
+  }
+  sink->name = name;
+  sink_configure(sink, policy, depth);
+
+  sinks[sink_count++] = sink;
+  metrics_updated = sink_publish;
+  metrics_pushing = sink_push_metrics;
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * The consumers run on the Modbus thread (event loop): SINK_BLOCK then drops the oldest snapshot instead of waiting
+ */
+void sink_set_inline(const bool value) { atomic_store(&sink_inline, value); }
+
+#endif /* GROWATT_SINK_H */
@@ -0,0 +1,188 @@
+#ifndef GROWATT_SPAN_H
+#define GROWATT_SPAN_H
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "log.h"
+#include "reload.h"
+#include "trace.h"
+
+#undef LOG_TAG
+#define LOG_TAG "96m[SPAN] "
+
+enum {
+  SPAN_BUFFER_SIZE = 4096U, // spans kept per thread, the oldest ones are overwritten
+  SPAN_MAX_THREADS = 8U,
+};
+
+/**
+ * A timed section of the pipeline, names are string literals
+ */
+typedef struct {
+  const char *name;
+  /** Name of the argument shown along with the span, e.g. "address" (optional) */
+  const char *arg_name;
+  /** Microseconds, see trace_clock() */
+  uint64_t begin;
+  uint32_t duration;
+  int32_t arg;
+} SPAN;
+
+/**
+ * Spans of one thread: only that thread writes, dumps read them concurrently and skip the ones overwritten meanwhile
+ */
+typedef struct {
+  SPAN spans[SPAN_BUFFER_SIZE];
+  /** Number of spans recorded so far, the last SPAN_BUFFER_SIZE of them are kept */
+  atomic_size_t count;
+  char const *thread;
+} SPAN_BUFFER;
+
+// NOLINTBEGIN(cppcoreguidelines-avoid-non-const-global-variables)
+static atomic_bool spans_enabled;
+static char span_file[CONFIG_STRING_SIZE]; // written on SIGUSR2, belongs to the thread handling signals
+static SPAN_BUFFER *_Atomic span_buffers[SPAN_MAX_THREADS];
+static atomic_size_t span_buffer_count;
+static _Thread_local SPAN_BUFFER *span_buffer;
+static _Thread_local char const *span_thread_name = "main";
+// NOLINTEND(cppcoreguidelines-avoid-non-const-global-variables)
+
+/**
+ * Record spans when path is not empty, dumped to it on SIGUSR2 and served on GET /trace
+ */
+void init_spans(char const path[static 1]) {
+  strlcpy(span_file, path, sizeof(span_file));
+  atomic_store_explicit(&spans_enabled, path[0] != '\0', memory_order_relaxed);
+}
+
+bool spans_recorded(void) { return atomic_load_explicit(&spans_enabled, memory_order_relaxed); }
+
+/**
+ * Label the spans of the calling thread
+ */
+void span_thread(char const name[static 1]) {
+  span_thread_name = name;
+  if (span_buffer) {
+    span_buffer->thread = name;
+  }
+}
+
+/**
+ * Start of a span to pass to span_end(), 0 when tracing is disabled
+ */
+uint64_t span_begin(void) { return atomic_load_explicit(&spans_enabled, memory_order_relaxed) ? trace_clock() : 0; }
+
+static SPAN_BUFFER *span_thread_buffer(void) {
+  static _Thread_local bool failed = false;
+  if (span_buffer || failed) {
+    return span_buffer;
+  }
+
+  const size_t index = atomic_fetch_add(&span_buffer_count, 1);
+  SPAN_BUFFER *buffer = index < SPAN_MAX_THREADS ? calloc(1, sizeof(SPAN_BUFFER)) : NULL;
+  if (buffer == NULL) {
+    LOG(LOG_ERROR, "Cannot record the spans of thread %s", span_thread_name);
+    failed = true;
+    return NULL;
+  }
+
+  buffer->thread = span_thread_name;
+  atomic_store_explicit(&span_buffers[index], buffer, memory_order_release);
+  span_buffer = buffer;
+
+  return buffer;
+}
+
+/**
+ * Record the span started at begin, with an optional integer argument
+ */
+void span_end(const uint64_t begin, char const name[static 1], const char *arg_name, const int arg) {
+  if (begin == 0) {
+    return;
+  }
+
+  SPAN_BUFFER *buffer = span_thread_buffer();
+  if (buffer == NULL) {
+    return;
+  }
+
+  const size_t count = atomic_load_explicit(&buffer->count, memory_order_relaxed);
+  buffer->spans[count % SPAN_BUFFER_SIZE] = (SPAN){name, arg_name, begin, (uint32_t)(trace_clock() - begin), arg};
+  atomic_store_explicit(&buffer->count, count + 1, memory_order_release);
+}
+
+/**
+ * Write the recorded spans of all threads as Chrome trace-event JSON (for Perfetto or chrome://tracing),
+ * returns the number of spans written
+ */
+size_t span_dump(FILE *file) {
+  size_t written = 0;
+  bool first = true;
+  fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", file);
+
+  const size_t buffers = atomic_load(&span_buffer_count);
+  for (size_t tid = 0; tid < buffers && tid < SPAN_MAX_THREADS; tid++) {
+    const SPAN_BUFFER *buffer = atomic_load_explicit(&span_buffers[tid], memory_order_acquire);
+    if (buffer == NULL) {
+      continue;
+    }
+
+    fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":\"%s\"}}", first ? "" : ",",
+            tid, buffer->thread);
+    first = false;
+
+    const size_t count = atomic_load_explicit(&buffer->count, memory_order_acquire);
+    for (size_t i = count > SPAN_BUFFER_SIZE ? count - SPAN_BUFFER_SIZE : 0; i < count; i++) {
+      const SPAN span = buffer->spans[i % SPAN_BUFFER_SIZE];
+      atomic_thread_fence(memory_order_acquire);
+      if (atomic_load_explicit(&buffer->count, memory_order_relaxed) >= i + SPAN_BUFFER_SIZE) {
+        continue; // overwritten (or being overwritten) while reading it
+      }
+
+      fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"ts\":%" PRIu64 ",\"dur\":%" PRIu32, span.name, tid,
+              span.begin, span.duration);
+      if (span.arg_name) {
+        fprintf(file, ",\"args\":{\"%s\":%" PRId32 "}", span.arg_name, span.arg);
+      }
+      fputc('}', file);
+      written++;
+    }
+  }
+
+  fputs("\n]}\n", file);
+
+  return written;
+}
+
+/**
+ * Dump the spans into span_file, on SIGUSR2
+ */
+int span_dump_file(void) {
+  if (span_file[0] == '\0') {
+    LOG(LOG_ERROR, "Spans are not recorded, see span_file");
+    return EXIT_FAILURE;
+  }
+
+  FILE *file = fopen(span_file, "we");
+  if (file == NULL) {
+    PERROR("Cannot write spans to %s", span_file);
+    return EXIT_FAILURE;
+  }
+
+  const size_t written = span_dump(file);
+  if (fclose(file)) {
+    PERROR("Cannot write spans to %s", span_file);
+    return EXIT_FAILURE;
+  }
+
+  LOG(LOG_INFO, "Wrote %zu spans to %s", written, span_file);
+
+  return EXIT_SUCCESS;
+}
+
+#endif /* GROWATT_SPAN_H */
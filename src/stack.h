@@ -0,0 +1,212 @@
+#ifndef GROWATT_STACK_H
+#define GROWATT_STACK_H
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <threads.h>
+
+#include "log.h"
+
+#undef LOG_TAG
+#define LOG_TAG "90m[STCK] "
+
+#if (defined(GROWATT_COMPACT) || defined(STACK_REPORT)) && !defined(_GNU_SOURCE)
+#error "GROWATT_COMPACT and STACK_REPORT need -D_GNU_SOURCE"
+#endif
+
+/**
+ * Stack reserved for each thread by the compact profile, about twice the high-water mark reported by
+ * "make size-report"; other builds keep the C library default (8 MiB of address space with glibc)
+ */
+enum {
+  STACK_SIZE_DEFAULT = 128U * 1024U, // threads not created by stack_thread(): the log writer, and the network thread
+                                     // of libmosquitto which runs getaddrinfo() when reconnecting
+  STACK_SIZE_MODBUS = 64U * 1024U,
+  STACK_SIZE_PROMETHEUS = 64U * 1024U,
+  STACK_SIZE_MQTT = 128U * 1024U,   // getaddrinfo() within libmosquitto
+  STACK_SIZE_INFLUX = 128U * 1024U, // getaddrinfo()
+  STACK_SIZE_SHM = 32U * 1024U,
+  STACK_MAX_THREADS = 8U,
+  STACK_PAINT = 0xA5,
+  STACK_PAINT_MARGIN = 1024U,      // bytes below the current frame left alone, painting needs some stack too
+  STACK_PAINT_MAX = 1024U * 1024U, // of the main thread, which can grow up to RLIMIT_STACK
+};
+
+typedef struct {
+  char const *label;
+  thrd_start_t start;
+  void *arg;
+  /** Top (highest address) of the stack, and the lowest byte painted */
+  unsigned char *top;
+  unsigned char *painted;
+  size_t size;
+  /** High-water mark, once the thread is done */
+  size_t used;
+  bool done;
+} STACK;
+
+// NOLINTBEGIN(cppcoreguidelines-avoid-non-const-global-variables)
+static STACK stacks[STACK_MAX_THREADS];
+static atomic_size_t stack_count;
+// NOLINTEND(cppcoreguidelines-avoid-non-const-global-variables)
+
+/**
+ * Size the stack of the threads created from now on without stack_thread(), within libraries too (compact profile only).
+ * This is the default of the whole process, set once before any thread starts.
+ */
+void stack_reserve(const size_t size) {
+#ifdef GROWATT_COMPACT
+  pthread_attr_t attr;
+  if (pthread_attr_init(&attr) == 0) {
+    if (pthread_attr_setstacksize(&attr, size) || pthread_setattr_default_np(&attr)) {
+      LOG(LOG_ERROR, "Cannot reserve %zu bytes of stack per thread", size);
+    }
+    pthread_attr_destroy(&attr);
+  }
+#else
+  (void)size;
+#endif
+}
+
+#ifdef GROWATT_COMPACT
+static_assert(sizeof(thrd_t) == sizeof(pthread_t), "C11 threads are POSIX threads with glibc and musl");
+
+typedef struct {
+  thrd_start_t start;
+  void *arg;
+} STACK_START;
+
+static void *stack_start(void *start_ptr) {
+  const STACK_START start = *(const STACK_START *)start_ptr;
+  free(start_ptr);
+  return (void *)(intptr_t)start.start(start.arg); // what thrd_join() expects
+}
+#endif
+
+/**
+ * thrd_create() with a stack of size bytes in the compact profile, leaving the default of the process alone
+ */
+static int stack_create(thrd_t *thread, thrd_start_t start, void *arg, const size_t size) {
+#ifdef GROWATT_COMPACT
+  STACK_START *context = malloc(sizeof(STACK_START));
+  pthread_attr_t attr;
+  if (context == NULL || pthread_attr_init(&attr)) {
+    free(context);
+    return thrd_nomem;
+  }
+
+  *context = (STACK_START){start, arg};
+  int code = pthread_attr_setstacksize(&attr, size);
+  if (code == 0) {
+    code = pthread_create((pthread_t *)thread, &attr, stack_start, context);
+  }
+  pthread_attr_destroy(&attr);
+  if (code) {
+    LOG(LOG_ERROR, "Cannot create a thread with %zu bytes of stack", size);
+    free(context);
+    return code == ENOMEM || code == EAGAIN ? thrd_nomem : thrd_error;
+  }
+
+  return thrd_success;
+#else
+  (void)size;
+  return thrd_create(thread, start, arg);
+#endif
+}
+
+#ifdef STACK_REPORT
+/**
+ * Fill the unused part of the stack of the calling thread with STACK_PAINT, so that the bytes left untouched later on
+ * tell how deep it went
+ */
+static void stack_paint(STACK *stack) {
+  pthread_attr_t attr;
+  void *low = NULL;
+  size_t size = 0;
+  if (pthread_getattr_np(pthread_self(), &attr) || pthread_attr_getstack(&attr, &low, &size)) {
+    return;
+  }
+  pthread_attr_destroy(&attr);
+
+  unsigned char *frame = (unsigned char *)__builtin_frame_address(0) - STACK_PAINT_MARGIN;
+  stack->top = (unsigned char *)low + size;
+  stack->painted = frame - (unsigned char *)low > STACK_PAINT_MAX ? frame - STACK_PAINT_MAX : low;
+  stack->size = (size_t)(stack->top - stack->painted);
+  for (volatile unsigned char *byte = stack->painted; byte < frame; byte++) {
+    *byte = STACK_PAINT;
+  }
+}
+
+static size_t stack_used(const STACK *stack) {
+  const unsigned char *byte = stack->painted;
+  while (byte < stack->top && *byte == STACK_PAINT) {
+    byte++;
+  }
+
+  return (size_t)(stack->top - byte);
+}
+
+static int stack_run(void *stack_ptr) {
+  STACK *stack = stack_ptr;
+  stack_paint(stack);
+  const int value = stack->start(stack->arg);
+  stack->used = stack_used(stack);
+  stack->done = true;
+  return value;
+}
+#endif
+
+/**
+ * thrd_create() with a stack of size bytes in the compact profile, and measured when built with STACK_REPORT
+ */
+int stack_thread(thrd_t *thread, thrd_start_t start, void *arg, char const label[static 1], const size_t size) {
+#ifdef STACK_REPORT
+  const size_t index = atomic_fetch_add(&stack_count, 1);
+  if (index < STACK_MAX_THREADS) {
+    stacks[index] = (STACK){.label = label, .start = start, .arg = arg};
+    return stack_create(thread, stack_run, &stacks[index], size);
+  }
+#else
+  (void)label;
+#endif
+
+  return stack_create(thread, start, arg, size);
+}
+
+/**
+ * Measure the stack of the calling thread too, which must outlive stack_report()
+ */
+void stack_track(char const label[static 1]) {
+#ifdef STACK_REPORT
+  const size_t index = atomic_fetch_add(&stack_count, 1);
+  if (index < STACK_MAX_THREADS) {
+    stacks[index] = (STACK){.label = label};
+    stack_paint(&stacks[index]);
+  }
+#else
+  (void)label;
+#endif
+}
+
+/**
+ * Log the stack high-water mark of every thread (STACK_REPORT builds only)
+ */
+void stack_report(void) {
+#ifdef STACK_REPORT
+  const size_t count = atomic_load(&stack_count);
+  for (size_t i = 0; i < count && i < STACK_MAX_THREADS; i++) {
+    const STACK *stack = &stacks[i];
+    if (stack->top) {
+      LOG(LOG_INFO, "Stack high-water mark of %s: %zu of %zu bytes", stack->label, stack->done ? stack->used : stack_used(stack),
+          stack->size);
+    }
+  }
+#endif
+}
+
+#endif /* GROWATT_STACK_H */
@@ -0,0 +1,266 @@
+#ifndef GROWATT_STATE_H
+#define GROWATT_STATE_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <time.h>
+#include <unistd.h> // fsync()
+
+#include "latency.h"
+#include "log.h"
+#include "modbus.h"
+#include "reload.h"
+
+#undef LOG_TAG
+#define LOG_TAG "93m[STAT] "
+
+enum {
+  STATE_MAGIC = 0x54535747U, // "GWST"
+  STATE_VERSION = 3U,
+  STATE_SAVE_PERIOD = 60, // seconds, the state is also saved when exiting
+  STATE_MAX_METRICS = 1024U, // per slave, anything larger is a corrupted file
+};
+
+#define STATE_TEMPORARY_SUFFIX ".tmp"
+
+/**
+ * Beginning of the state file, followed by slave_count times a STATE_SLAVE and its metrics
+ */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  /** Sizes of the records, so that a file written by a build with other register tables is ignored */
+  uint32_t slave_size;
+  uint32_t metric_size;
+  uint32_t slave_count;
+  int64_t polled_at;
+  char device_or_uri[CONFIG_STRING_SIZE];
+  LATENCY latency;
+} STATE_HEADER;
+
+typedef struct {
+  int32_t slave_id;
+  /** Number of METRIC following */
+  uint32_t size;
+  int64_t last_time_synced_at;
+  int64_t last_time_read_settings_at;
+  REGISTER_STATE holding_states[COUNT(holding_registers)];
+  REGISTER_STATE input_states[COUNT(input_registers)];
+} STATE_SLAVE;
+
+/**
+ * Everything worth keeping across restarts is saved by the Modbus thread
+ */
+typedef struct {
+  char path[CONFIG_STRING_SIZE];
+  time_t saved_at;
+} STATE;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static STATE state;
+
+static int write_state(FILE *file, const modbus_config *config) {
+  const size_t count = atomic_load(&slave_count);
+  STATE_HEADER header = {
+      .magic = STATE_MAGIC,
+      .version = STATE_VERSION,
+      .slave_size = sizeof(STATE_SLAVE),
+      .metric_size = sizeof(METRIC),
+      .slave_count = (uint32_t)count,
+      .latency = bus.latency,
+  };
+  strlcpy(header.device_or_uri, config->device_or_uri, CONFIG_STRING_SIZE);
+
+  mtx_lock(&refresh.mutex);
+  header.polled_at = refresh.polled_at;
+  mtx_unlock(&refresh.mutex);
+
+  if (fwrite(&header, sizeof(header), 1, file) != 1) {
+    return EXIT_FAILURE;
+  }
+
+  for (size_t index = 0; index < count; index++) {
+    METRICS *metrics = &device_metrics[index];
+    STATE_SLAVE slave = {
+        .slave_id = metrics->slave_id,
+        .last_time_synced_at = metrics->last_time_synced_at,
+        .last_time_read_settings_at = metrics->last_time_read_settings_at,
+    };
+    memcpy(slave.holding_states, metrics->holding_states, sizeof(slave.holding_states));
+    memcpy(slave.input_states, metrics->input_states, sizeof(slave.input_states));
+
+    mtx_lock(&metrics->mutex);
+    slave.size = (uint32_t)metrics->size;
+    const bool written = fwrite(&slave, sizeof(slave), 1, file) == 1 &&
+                         fwrite(metrics->metrics, sizeof(METRIC), metrics->size, file) == metrics->size;
+    mtx_unlock(&metrics->mutex);
+
+    if (!written) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Write the state into a temporary file renamed over the previous one, so that a crash never leaves a partial file.
+ * Unless forced, saves at most every STATE_SAVE_PERIOD seconds. Must be called by the thread owning the Modbus
+ * connection.
+ */
+int save_state(const modbus_config *config, const bool force) {
+  const time_t now = time(NULL);
+  if (!state.path[0] || (!force && difftime(now, state.saved_at) < STATE_SAVE_PERIOD)) {
+    return EXIT_SUCCESS;
+  }
+  state.saved_at = now;
+
+  char temporary[CONFIG_STRING_SIZE + sizeof(STATE_TEMPORARY_SUFFIX)];
+  snprintf(temporary, sizeof(temporary), "%s" STATE_TEMPORARY_SUFFIX, state.path);
+
+  FILE *file = fopen(temporary, "we");
+  if (file == NULL) {
+    PERROR("Cannot write state file %s", temporary);
+    return EXIT_FAILURE;
+  }
+
+  int code = write_state(file, config);
+  if (code == EXIT_SUCCESS && (fflush(file) || fsync(fileno(file)))) {
+    code = EXIT_FAILURE;
+  }
+  if (fclose(file)) {
+    code = EXIT_FAILURE;
+  }
+
+  if (code != EXIT_SUCCESS || rename(temporary, state.path)) {
+    PERROR("Cannot write state file %s", state.path);
+    unlink(temporary);
+    return EXIT_FAILURE;
+  }
+
+  LOG(LOG_DEBUG, "State saved to %s", state.path);
+
+  return EXIT_SUCCESS;
+}
+
+static void save_state_periodically(const modbus_config *config) { save_state(config, false); }
+
+static void save_state_finally(const modbus_config *config) { save_state(config, true); }
+
+/**
+ * Publish metrics restored from the state file, flagged as stale until the first cycle replaces them
+ */
+static void restore_metrics(METRICS *metrics, METRIC *restored, size_t size) {
+  size_t index = 0;
+  while (index < size && strcmp(restored[index].name, "stale") != 0) {
+    index++;
+  }
+  if (index == size) {
+    METRIC *grown = realloc(restored, (size + 1) * sizeof(METRIC));
+    if (grown == NULL) {
+      free(restored);
+      return;
+    }
+    restored = grown;
+    strlcpy(restored[size].name, "stale", sizeof(restored[size].name));
+    restored[size].at = realtime_ms();
+    restored[size++].expires_at = INT64_MAX;
+  }
+  restored[index].value = 1;
+
+  mtx_lock(&metrics->mutex);
+  free(metrics->metrics);
+  metrics->metrics = restored;
+  metrics->size = size;
+  mtx_unlock(&metrics->mutex);
+  metrics_changed((size_t)(metrics - device_metrics));
+}
+
+static int read_state(FILE *file, const modbus_config *config) {
+  STATE_HEADER header;
+  if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != STATE_MAGIC || header.version != STATE_VERSION ||
+      header.slave_size != sizeof(STATE_SLAVE) || header.metric_size != sizeof(METRIC)) {
+    LOG(LOG_ERROR, "State file %s is invalid or was written by another version, ignoring it", state.path);
+    return EXIT_FAILURE;
+  }
+
+  if (strncmp(header.device_or_uri, config->device_or_uri, CONFIG_STRING_SIZE) != 0) {
+    LOG(LOG_INFO, "State file %s was written for %s, ignoring it", state.path, header.device_or_uri);
+    return EXIT_SUCCESS;
+  }
+
+  for (uint32_t i = 0; i < header.slave_count; i++) {
+    STATE_SLAVE slave;
+    if (fread(&slave, sizeof(slave), 1, file) != 1 || slave.size > STATE_MAX_METRICS) {
+      return EXIT_FAILURE;
+    }
+
+    METRIC *restored = malloc((slave.size ? slave.size : 1) * sizeof(METRIC));
+    if (restored == NULL || fread(restored, sizeof(METRIC), slave.size, file) != slave.size) {
+      free(restored);
+      return EXIT_FAILURE;
+    }
+    for (uint32_t m = 0; m < slave.size; m++) {
+      restored[m].name[sizeof(restored[m].name) - 1] = '\0';
+    }
+
+    const size_t index = find_slave(slave.slave_id);
+    if (index == SIZE_MAX) {
+      free(restored); // not polled anymore
+      continue;
+    }
+
+    METRICS *metrics = &device_metrics[index];
+    metrics->last_time_synced_at = (time_t)slave.last_time_synced_at;
+    metrics->last_time_read_settings_at = (time_t)slave.last_time_read_settings_at;
+    memcpy(metrics->holding_states, slave.holding_states, sizeof(slave.holding_states));
+    memcpy(metrics->input_states, slave.input_states, sizeof(slave.input_states));
+    restore_metrics(metrics, restored, slave.size);
+  }
+
+  bus.latency = header.latency;
+
+  mtx_lock(&refresh.mutex);
+  refresh.polled_at = (time_t)header.polled_at;
+  mtx_unlock(&refresh.mutex);
+
+  LOG(LOG_INFO, "Restored state of %" PRIu32 " slaves from %s", header.slave_count, state.path);
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Must be called after init_modbus() and before any thread starts, loads the state file at path if any
+ */
+int init_state(char const path[static 1], const modbus_config *config) {
+  strlcpy(state.path, path, CONFIG_STRING_SIZE);
+  if (!state.path[0]) {
+    return EXIT_SUCCESS;
+  }
+
+  poll_completed = save_state_periodically;
+  poll_stopped = save_state_finally;
+  state.saved_at = time(NULL); // the file is fresh enough already
+
+  FILE *file = fopen(state.path, "re");
+  if (file == NULL) {
+    if (errno != ENOENT) {
+      PERROR("Cannot read state file %s", state.path);
+    }
+    return EXIT_SUCCESS; // starting cold
+  }
+
+  if (read_state(file, config) != EXIT_SUCCESS) {
+    // partially restored slaves are consistent on their own, the next cycles take over
+    LOG(LOG_ERROR, "Could not restore everything from %s", state.path);
+  }
+  fclose(file);
+
+  return EXIT_SUCCESS;
+}
+
+#endif /* GROWATT_STATE_H */
@@ -0,0 +1,125 @@
+#ifndef GROWATT_TRACE_H
+#define GROWATT_TRACE_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+enum {
+  TRACE_MAGIC = 0x52545747U, // "GWTR"
+  TRACE_VERSION = 1U,
+  TRACE_TIMEOUT = -1, // status of a request which got no (valid) response
+};
+
+typedef struct __attribute__((packed)) {
+  uint32_t magic;
+  uint32_t version;
+} TRACE_HEADER;
+
+/**
+ * One Modbus transaction, followed by count words: the registers read, or written
+ */
+typedef struct __attribute__((packed)) {
+  /** Microseconds from the start of the trace to the request */
+  uint64_t at;
+  /** Microseconds until the response (or the timeout) */
+  uint32_t duration;
+  uint8_t slave;
+  uint8_t function;
+  uint16_t address;
+  uint16_t count;
+  /** 0 when successful, the exception code when the device refused it, TRACE_TIMEOUT otherwise */
+  int16_t status;
+} TRACE_RECORD;
+
+typedef struct {
+  FILE *file;
+  uint64_t started_at;
+} TRACE;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static TRACE trace = {NULL, 0};
+
+static uint64_t trace_clock(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000U + (uint64_t)now.tv_nsec / 1000U; // NOLINT(readability-magic-numbers)
+}
+
+/**
+ * Start recording every transaction into a new trace file
+ */
+int trace_open(char const path[static 1]) {
+  trace.file = fopen(path, "we");
+  if (trace.file == NULL) {
+    return EXIT_FAILURE;
+  }
+
+  const TRACE_HEADER header = {TRACE_MAGIC, TRACE_VERSION};
+  if (fwrite(&header, sizeof(header), 1, trace.file) != 1) {
+    fclose(trace.file);
+    trace.file = NULL;
+    return EXIT_FAILURE;
+  }
+
+  trace.started_at = trace_clock();
+
+  return EXIT_SUCCESS;
+}
+
+bool trace_enabled(void) { return trace.file != NULL; }
+
+/**
+ * Append a transaction which started at started_at (see trace_clock()), flushed right away so that a trace of a
+ * crashing exporter is complete
+ */
+void trace_record(const uint8_t slave, const uint8_t function, const int address, const int count, const uint64_t started_at,
+                  const int status, const uint16_t *words) {
+  if (trace.file == NULL) {
+    return;
+  }
+
+  const TRACE_RECORD record = {
+      .at = started_at - trace.started_at,
+      .duration = (uint32_t)(trace_clock() - started_at),
+      .slave = slave,
+      .function = function,
+      .address = (uint16_t)address,
+      .count = (uint16_t)count,
+      .status = (int16_t)status,
+  };
+  const size_t words_count = status == 0 && words ? (size_t)count : 0;
+
+  if (fwrite(&record, sizeof(record), 1, trace.file) != 1 || fwrite(words, sizeof(uint16_t), words_count, trace.file) != words_count ||
+      fflush(trace.file)) {
+    fprintf(stderr, "Writing trace failed: %s, recording stopped\n", strerror(errno)); // NOLINT(concurrency-mt-unsafe)
+    fclose(trace.file);
+    trace.file = NULL;
+  }
+}
+
+void trace_close(void) {
+  if (trace.file) {
+    fclose(trace.file);
+    trace.file = NULL;
+  }
+}
+
+/**
+ * Read the next transaction of a trace opened by the caller, words must hold up to UINT16_MAX values.
+ * Returns false at the end of the trace.
+ */
+bool trace_next(FILE *file, TRACE_RECORD *record, uint16_t *words) {
+  if (fread(record, sizeof(*record), 1, file) != 1) {
+    return false;
+  }
+
+  const size_t words_count = record->status == 0 ? record->count : 0;
+  return fread(words, sizeof(uint16_t), words_count, file) == words_count;
+}
+
+#endif /* GROWATT_TRACE_H */
@@ -0,0 +1,132 @@
+#include <arpa/inet.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <zlib.h>
+
+// stands in for InfluxDB: checks the line protocol written by growatt_exporter, optionally failing the first writes
+enum { PORT = 8086, WRITES = 10, REQUEST_SIZE = 1024U * 1024U, BODY_SIZE = 8U * 1024U * 1024U };
+
+static char request[REQUEST_SIZE];
+static char body[BODY_SIZE];
+
+/**
+ * Whether line looks like "growatt[,slave=<id>] <field>=<value>[,...] <nanosecond timestamp>"
+ */
+static bool valid_line(const char *line) {
+  const char *fields = strchr(line, ' ');
+  const char *timestamp = fields ? strchr(fields + 1, ' ') : NULL;
+
+  return !strncmp(line, "growatt", strlen("growatt")) && (line[strlen("growatt")] == ' ' || line[strlen("growatt")] == ',') &&
+         timestamp && strchr(fields, '=') < timestamp && strspn(timestamp + 1, "0123456789") == strlen("1700000000000000000");
+}
+
+/**
+ * Read one request, returns the number of lines written or -1 if anything is wrong with it
+ */
+static int receive_write(const int client_fd) {
+  size_t size = 0;
+  char *end = NULL;
+  request[0] = '\0';
+  while (size < sizeof(request) - 1 && (end = strstr(request, "\r\n\r\n")) == NULL) {
+    const ssize_t received = recv(client_fd, request + size, sizeof(request) - 1 - size, 0);
+    if (received <= 0) {
+      return -1;
+    }
+    size += (size_t)received;
+    request[size] = '\0';
+  }
+
+  const char *length_header = strstr(request, "\r\nContent-Length: ");
+  if (end == NULL || strncmp(request, "POST /", strlen("POST /")) || length_header == NULL) {
+    return -1;
+  }
+
+  const size_t length = strtoul(length_header + strlen("\r\nContent-Length: "), NULL, 10); // NOLINT(readability-magic-numbers)
+  const size_t header_size = (size_t)(end - request) + strlen("\r\n\r\n");
+  while (size < header_size + length && size < sizeof(request) - 1) {
+    const ssize_t received = recv(client_fd, request + size, sizeof(request) - 1 - size, 0);
+    if (received <= 0) {
+      return -1;
+    }
+    size += (size_t)received;
+  }
+
+  if (size != header_size + length) {
+    return -1;
+  }
+
+  size_t body_size = length;
+  if (strstr(request, "\r\nContent-Encoding: gzip\r\n")) {
+    z_stream stream = {.next_in = (Bytef *)request + header_size, .avail_in = (uInt)length};
+    stream.next_out = (Bytef *)body;
+    stream.avail_out = sizeof(body) - 1;
+    if (inflateInit2(&stream, 15 + 16) != Z_OK || inflate(&stream, Z_FINISH) != Z_STREAM_END) { // NOLINT(readability-magic-numbers)
+      return -1;
+    }
+    body_size = stream.total_out;
+    inflateEnd(&stream);
+    printf("Inflated %zu bytes into %zu\n", length, body_size);
+  } else {
+    memcpy(body, request + header_size, length);
+  }
+  body[body_size] = '\0';
+
+  int lines = 0;
+  for (char *line = strtok(body, "\n"); line; line = strtok(NULL, "\n")) {
+    if (!valid_line(line)) {
+      printf("Invalid line: %s\n", line);
+      return -1;
+    }
+    lines++;
+  }
+
+  return lines;
+}
+
+int main(int argc, char *argv[argc + 1]) {
+  const int failures = argc > 1 ? atoi(argv[1]) : 0; // NOLINT(cert-err34-c)
+
+  const int server = socket(AF_INET, SOCK_STREAM, 0);
+  const struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = htons(PORT), .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
+  if (bind(server, (const struct sockaddr *)&address, sizeof(address)) || listen(server, 1)) {
+    perror("InfluxDB stand-in cannot listen");
+    return EXIT_FAILURE;
+  }
+
+  int code = EXIT_SUCCESS;
+  for (int writes = 0; writes < WRITES;) {
+    const int client_fd = accept(server, NULL, NULL);
+    if (client_fd < 0) {
+      perror("accept");
+      code = EXIT_FAILURE;
+      break;
+    }
+
+    const int lines = receive_write(client_fd);
+    const char *status = "HTTP/1.1 204 No Content\r\n";
+    if (lines < 0) {
+      status = "HTTP/1.1 400 Bad Request\r\n";
+      code = EXIT_FAILURE;
+    } else if (writes < failures) {
+      status = "HTTP/1.1 503 Service Unavailable\r\n"; // the same lines must come again
+    }
+    writes++;
+
+    printf("Write %d: %d lines, answering %.*s\n", writes, lines, (int)strcspn(status, "\r"), status);
+    const char *headers = "Content-Length: 0\r\n\r\n";
+    if (write(client_fd, status, strlen(status)) < 0 || write(client_fd, headers, strlen(headers)) < 0) {
+      perror("write");
+    }
+    close(client_fd);
+  }
+
+  close(server);
+  printf("InfluxDB stand-in exiting\n");
+
+  return code;
+}
@@ -2,18 +2,179 @@
 #include "../src/modbus.h"
 #include <assert.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <modbus.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 
-enum { PORT = 1502, MS = 1000U };
+enum { PORT = 1502, MS = 1000U, TABLE_SIZE = UINT16_MAX + 1 };
+
+/**
+ * Transactions of a trace recorded with growatt_exporter --record, and the words following each of them
+ */
+typedef struct {
+  TRACE_RECORD *records;
+  uint16_t **words;
+  size_t size;
+  /** All transactions address the same unit: its id is not matched, since it differs once replayed over TCP */
+  bool single_unit;
+  /** Index of the next transaction expected */
+  size_t next;
+  size_t unmatched;
+} REPLAY;
+
+static int load_trace(REPLAY *replay, char const path[static 1]) {
+  FILE *file = fopen(path, "re");
+  TRACE_HEADER header;
+  if (file == NULL || fread(&header, sizeof(header), 1, file) != 1 || header.magic != TRACE_MAGIC ||
+      header.version != TRACE_VERSION) {
+    fprintf(stderr, "Cannot read trace %s\n", path);
+    if (file) {
+      fclose(file);
+    }
+    return EXIT_FAILURE;
+  }
+
+  static uint16_t words[TABLE_SIZE];
+  TRACE_RECORD record;
+  while (trace_next(file, &record, words)) {
+    TRACE_RECORD *records = realloc(replay->records, (replay->size + 1) * sizeof(TRACE_RECORD));
+    uint16_t **all_words = realloc(replay->words, (replay->size + 1) * sizeof(uint16_t *));
+    if (records) {
+      replay->records = records;
+    }
+    if (all_words) {
+      replay->words = all_words;
+    }
+
+    const size_t words_count = record.status == 0 ? record.count : 0;
+    uint16_t *copy = malloc((words_count ? words_count : 1) * sizeof(uint16_t));
+    if (records == NULL || all_words == NULL || copy == NULL) {
+      free(copy);
+      fclose(file);
+      return EXIT_FAILURE;
+    }
+
+    memcpy(copy, words, words_count * sizeof(uint16_t));
+    replay->records[replay->size] = record;
+    replay->words[replay->size++] = copy;
+  }
+
+  fclose(file);
+  replay->single_unit = true;
+  for (size_t i = 1; i < replay->size; i++) {
+    replay->single_unit = replay->single_unit && replay->records[i].slave == replay->records[0].slave;
+  }
+  printf("Replaying %zu transactions from %s\n", replay->size, path);
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Answer req the way the device answered the same transaction when recorded, speed times faster.
+ * Requests which don't match the next transactions of the trace get an exception, which the caller counts.
+ * Returns -1 when replying failed.
+ */
+static int replay_request(modbus_t *ctx, modbus_mapping_t *mapping, REPLAY *replay, const uint8_t *req, const int len,
+                          const double speed) {
+  const int offset = modbus_get_header_length(ctx);
+  const uint8_t slave = req[offset - 1];
+  const uint8_t function = req[offset];
+  const uint16_t address = (uint16_t)(req[offset + 1] << 8 | req[offset + 2]); // NOLINT(hicpp-signed-bitwise)
+  const uint16_t count = function == MODBUS_FC_WRITE_SINGLE_REGISTER ? 1 : (uint16_t)(req[offset + 3] << 8 | req[offset + 4]); // NOLINT
+
+  // the exporter may skip transactions (e.g. a dead unit), so look ahead rather than only at the next one
+  size_t index = replay->next;
+  while (index < replay->size &&
+         ((!replay->single_unit && replay->records[index].slave != slave) || replay->records[index].function != function ||
+          replay->records[index].address != address || replay->records[index].count != count)) {
+    index++;
+  }
+
+  if (index == replay->size) {
+    printf("Unexpected request: slave %" PRIu8 ", function 0x%02" PRIx8 ", %" PRIu16 " registers from %" PRIu16 "\n", slave,
+           function, count, address);
+    replay->unmatched++;
+    return modbus_reply_exception(ctx, req, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+  }
+
+  const TRACE_RECORD *record = &replay->records[index];
+  replay->next = index + 1;
+  usleep((useconds_t)(record->duration / speed));
 
-int main(void) {
+  if (record->status == TRACE_TIMEOUT) {
+    return 0; // let the exporter time out
+  }
+  if (record->status > 0) {
+    return modbus_reply_exception(ctx, req, (unsigned)record->status);
+  }
+
+  if (function == MODBUS_FC_READ_HOLDING_REGISTERS || function == MODBUS_FC_READ_INPUT_REGISTERS) {
+    uint16_t *table = function == MODBUS_FC_READ_HOLDING_REGISTERS ? mapping->tab_registers : mapping->tab_input_registers;
+    memcpy(&table[address], replay->words[index], count * sizeof(uint16_t));
+  }
+
+  return modbus_reply(ctx, req, len, mapping);
+}
+
+/**
+ * Without arguments, simulate an inverter. With a trace recorded by growatt_exporter --record, answer like the
+ * recorded device, speed times faster (1 by default), and exit once the trace is over.
+ */
+int main(int argc, char *argv[argc + 1]) {
   // rand() initialization, should only be called once
   srand(time(NULL)); // NOLINT(cert-msc32-c,cert-msc51-cpp)
 
+  REPLAY replay = {0};
+  const double speed = argc > 2 ? strtod(argv[2], NULL) : 1;
+  if (argc > 3 || !(speed > 0) || (argc > 1 && load_trace(&replay, argv[1]))) {
+    fprintf(stderr, "Usage: %s [<trace_file> [<speed>]]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (argc > 1) {
+    modbus_mapping_t *mapping = modbus_mapping_new(0, 0, TABLE_SIZE, TABLE_SIZE);
+    modbus_t *ctx = modbus_new_tcp("127.0.0.1", PORT);
+    if (mapping == NULL || ctx == NULL) {
+      fprintf(stderr, "Failed to allocate the mapping: %s\n", modbus_strerror(errno));
+      return EXIT_FAILURE;
+    }
+
+    int socket = modbus_tcp_listen(ctx, 1);
+    modbus_tcp_accept(ctx, &socket);
+
+    const double started_at = (double)trace_clock();
+    uint8_t req[MODBUS_TCP_MAX_ADU_LENGTH];
+    int len = -1;
+    while (replay.next < replay.size && (len = modbus_receive(ctx, req)) != -1) {
+      if (len > 0 && replay_request(ctx, mapping, &replay, req, len, speed) == -1) {
+        perror("modbus_reply");
+        break;
+      }
+    }
+
+    // NOLINTBEGIN(readability-magic-numbers)
+    const TRACE_RECORD *last = replay.size ? &replay.records[replay.size - 1] : NULL;
+    const double recorded = last ? (double)(last->at + last->duration) / 1e6 : 0;
+    const double elapsed = ((double)trace_clock() - started_at) / 1e6;
+    // NOLINTEND(readability-magic-numbers)
+    printf("Replayed %zu/%zu transactions in %.3fs (recorded in %.3fs), %zu unexpected requests\n", replay.next, replay.size,
+           elapsed, recorded, replay.unmatched);
+
+    if (socket != -1) {
+      close(socket);
+    }
+    modbus_mapping_free(mapping);
+    modbus_close(ctx);
+    modbus_free(ctx);
+
+    return replay.next == replay.size && replay.unmatched == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
   // assert there is nothing relevant after the clock register
   assert(holding_registers[COUNT(holding_registers) - 1].address < REGISTER_CLOCK_ADDRESS + REGISTER_CLOCK_SIZE);
 
@@ -0,0 +1,70 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/growatt-shm.h"
+
+// reads the shared memory published by growatt_exporter (shm_name), the way a local consumer would:
+// "./tests/shm-reader /growatt-exporter battery_soc pv1_watts" prints these values of each unit and how long a read takes
+enum { MAX_NAMES = 16, READS = 1000000, NS_PER_S = 1000000000 };
+
+static double elapsed_ns(const struct timespec *begin, const struct timespec *end) {
+  return (double)(end->tv_sec - begin->tv_sec) * NS_PER_S + (double)(end->tv_nsec - begin->tv_nsec);
+}
+
+int main(int argc, char *argv[argc + 1]) {
+  if (argc < 3 || argc - 2 > MAX_NAMES) {
+    fprintf(stderr, "Usage: %s <shm_name> <metric_name>...\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  GROWATT_SHM shm = {0};
+  if (growatt_shm_open(&shm, argv[1])) {
+    fprintf(stderr, "Cannot open %s: %s\n", argv[1], strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  const size_t count = (size_t)argc - 2;
+  int slots[MAX_NAMES];
+  for (size_t i = 0; i < count; i++) {
+    slots[i] = growatt_shm_find(&shm, argv[i + 2]);
+    if (slots[i] < 0) {
+      fprintf(stderr, "No metric named %s\n", argv[i + 2]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  GROWATT_SHM_SLOT values[MAX_NAMES];
+  int32_t slave_id = 0;
+  int code = EXIT_SUCCESS;
+  for (size_t unit = 0; unit < shm.header->unit_count; unit++) {
+    if (!growatt_shm_read(&shm, unit, slots, count, values, &slave_id)) {
+      fprintf(stderr, "Unit %zu is not consistent\n", unit);
+      code = EXIT_FAILURE;
+      continue;
+    }
+    if (slave_id == 0) {
+      continue; // not polled
+    }
+
+    for (size_t i = 0; i < count; i++) {
+      printf("slave %d: %s = %lf (read at %lld ms)\n", slave_id, argv[i + 2], values[i].value, (long long)values[i].at);
+    }
+  }
+
+  struct timespec begin;
+  struct timespec end;
+  size_t failed = 0;
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  for (int i = 0; i < READS; i++) {
+    failed += !growatt_shm_read(&shm, 0, slots, count, values, NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("%.1f ns per read of %zu values, %zu inconsistent\n", elapsed_ns(&begin, &end) / READS, count, failed);
+
+  growatt_shm_close(&shm);
+
+  return failed ? EXIT_FAILURE : code;
+}
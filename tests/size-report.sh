@@ -0,0 +1,63 @@
+#!/bin/bash
+
+# Builds the compact profile, runs it against tests/mock-server and checks the binary size, the peak RSS and the stack
+# high-water mark of each thread against a budget, which can be overridden from the environment.
+# Extra make arguments (e.g. STATIC=1) can be passed through MAKEFLAGS.
+
+set -euo pipefail
+
+cd "$(dirname "$0")/.."
+
+binary_budget=${BINARY_BUDGET:-524288} # bytes
+rss_budget=${RSS_BUDGET:-6144}         # KiB
+stack_budget=${STACK_BUDGET:-50}       # % of the stack reserved for each thread
+config=${CONFIG:-config-minimal.conf}
+target=growatt_exporter
+failed=0
+
+check() { # <label> <value> <budget> <unit>
+    local status=OK
+    if [ "$2" -gt "$3" ]; then
+        status=OVER
+        failed=1
+    fi
+    printf '%-16s %10s %-5s (budget %s)  %s\n' "$1" "$2" "$4" "$3" "$status"
+}
+
+# run the exporter until the mock server quits, prints its log and leaves its peak RSS in ./size-report.rss
+run() {
+    ./tests/mock-server >/dev/null &
+    sleep 1
+    ./$target "$config" 2>&1 &
+    local pid=$! rss=0 seconds=0
+    while kill -0 $pid 2>/dev/null; do
+        if [ $((seconds += 1)) -eq 120 ]; then
+            kill -TERM $pid # the mock server should have quit by now
+        fi
+        rss=$(awk '/^VmHWM:/ { print $2 }' /proc/$pid/status 2>/dev/null || echo "$rss")
+        curl -sf -o /dev/null http://localhost:1234/metrics || true
+        sleep 1
+    done
+    wait $pid || true
+    wait
+    echo "$rss" >size-report.rss
+}
+
+make -B PROFILE=compact $target >/dev/null
+size=$(stat -c %s $target)
+run >/dev/null
+rss=$(cat size-report.rss)
+
+make -B PROFILE=compact STACK_REPORT=1 $target >/dev/null
+stacks=$(run | sed 's/\x1b\[[0-9;]*m//g' | sed -n 's/.*Stack high-water mark of \([A-Z]*\): \([0-9]*\) of \([0-9]*\) bytes.*/\1 \2 \3/p')
+rm -f size-report.rss $target # instrumented
+
+echo "== $target (PROFILE=compact ${MAKEFLAGS:-})"
+check binary "$size" "$binary_budget" bytes
+check "peak RSS" "$rss" "$rss_budget" KiB
+while read -r label used reserved; do
+    [ -n "$label" ] || continue
+    check "stack $label" "$used" $((reserved * stack_budget / 100)) bytes
+done <<<"$stacks"
+
+exit $failed